@@ -1,4 +1,7 @@
 #include "focusmotion.h"
+#include "focusmotion_protocol.h"
+#include "focusmotion_kernels.h"
+#include "focusmotion_codec.h"
 #include <pebble.h>
 #include <pebble_process_info.h>
 
@@ -28,6 +31,27 @@
 #endif
 
 
+////////////////////////////////////////
+// event tracing
+// With tracing enabled, every event the library sees is logged as one line:
+//   FMT,<ms since startup>,<event>,<arg>,<arg>
+// and the contents of each received message, and the readings in each accelerometer batch (as AccelData),
+// follow it in FMD lines (hex), so that a session can be replayed deterministically against another build,
+// and the results compared.
+
+//#define FM_TRACE_ENABLED 1
+
+#if FM_TRACE_ENABLED
+#  define FM_TRACE(event, a, b) APP_LOG(APP_LOG_LEVEL_DEBUG, "FMT,%u,%s,%d,%d", (unsigned) (get_time_ms() - g_trace_start_ms), event, (int) (a), (int) (b))
+#  define FM_TRACE_DATA(data, size) trace_data(data, size)
+static uint32_t g_trace_start_ms = 0;
+static void trace_data(const uint8_t* data, int size);
+#else
+#  define FM_TRACE(event, a, b)
+#  define FM_TRACE_DATA(data, size)
+#endif
+
+
 ////////////////////////////////////////
 // version info
 
@@ -49,6 +73,16 @@ static const char* k_version_label =
 
 ////////////////////////////////////////
 
+// Buffers are sized at startup from the available heap (see size_buffers()), within these limits.
+#define ACCEL_BUF_MIN 100 // samples; 2 seconds at 50 Hz
+#define ACCEL_BUF_MAX 500
+#define OUTBOX_MIN 512
+#define OUTBOX_MAX 3000
+#define INBOX_MIN 384 // enough for a KEY_BLOB_CHUNK message
+#define INBOX_MAX 1024
+#define RESEND_BUF_MIN 1
+#define RESEND_BUF_MAX 10
+
 static bool g_inited = false;
 static bool g_recording = false;
 static bool g_connected = false;
@@ -61,18 +95,33 @@ static AccelDataHandler g_accel_handler = NULL;
 static BluetoothConnectionHandler g_bluetooth_handler = NULL;
 static FmRecordingHandler g_recording_handler = NULL;
 static FmConnectedHandler g_connected_handler = NULL;
+static FmBlobHandler g_blob_handler = NULL;
+
+// buffer for accelerometer samples.
+// This is a ring buffer, so sending doesn't have to shift the remaining samples down;
+// samples are added by accel_handler() and removed by send_data().
+// Each sample has the channels selected by the phone (see CHANNEL_*), so it is g_sample_channels int16s.
+static int16_t* g_accel_buf = NULL;
+static int g_accel_buf_size = 0; // capacity, in samples
+static uint8_t g_channels = CHANNELS_XYZ; // CHANNEL_* mask
+static int g_sample_channels = 3; // number of channels in g_channels
+static int g_accel_buf_start = 0; // index of the oldest sample in buffer
+static int g_accel_buf_count = 0; // number of samples in buffer
 
-// buffer for accelerometer samples
-typedef struct __attribute__ ((__packed__))
+// once the buffer is this full, send as soon as the outbox is free rather than waiting for the timer
+#define ACCEL_BUF_HIGH_WATER (g_accel_buf_size / 2)
+
+// samples dropped because g_accel_buf was full, so the offsets sent to the phone can skip over them.
+typedef struct
 {
-    int16_t x;
-    int16_t y;
-    int16_t z;
-} Sample;
+    int16_t index; // position in g_accel_buf (relative to the oldest sample) of the first sample after the gap
+    uint16_t length; // number of samples dropped
+} Gap;
 
-#define ACCEL_BUF_SIZE 500
-static Sample g_accel_buf[ACCEL_BUF_SIZE];
-static int g_accel_buf_count = 0; // number of samples in buffer
+#define MAX_GAPS 16 // room for the idle gaps around the strokes in the buffer (see SEGMENTS_MAX), and a few drops
+static Gap g_gaps[MAX_GAPS];
+static int g_gap_count = 0;
+static int g_samples_skipped = 0; // samples dropped before the oldest sample in g_accel_buf
 
 // buffer for messages to be re-sent
 typedef struct
@@ -81,22 +130,60 @@ typedef struct
     int size;
 } MsgBuf;
 
-#define RESEND_BUF_SIZE 10
-static MsgBuf g_resend_buf[RESEND_BUF_SIZE];
+static MsgBuf g_resend_buf[RESEND_BUF_MAX];
 static int g_resend_buf_count = 0;
+static int g_resend_buf_size = 0; // maximum number of messages waiting to be re-sent
 
 static int g_samples_sent = 0; // so we can compare with # received on phone
 static int g_samples_measured = 0; // since some might not have even been sent if g_accel_buf was full
+static int g_sample_limit = 0; // stop recording after this many samples (0 = no limit; see StartLimit)
+
+static FmStats g_stats; // counters for the current (or last) recording
+static uint32_t g_recording_start_ms = 0;
+static uint32_t g_outbox_send_ms = 0; // when the message currently in the outbox was sent
+static uint32_t g_latency_total_ms = 0;
+static uint32_t g_latency_count = 0;
 
 static int g_msg_flags = 0; // which messages need to be sent?
 
-static char g_metadata_buf[256]; // contains metadata about this app/device that is sent to phone
-static int g_metadata_len = 0;
+static uint32_t g_phone_metadata_hash = 0; // hash of the metadata the phone has cached, from the last connect message
 
 #define DEFAULT_SAMPLING_RATE ACCEL_SAMPLING_50HZ
 static AccelSamplingRate g_sampling_rate = DEFAULT_SAMPLING_RATE;
 static AccelSamplingRate g_next_sampling_rate = DEFAULT_SAMPLING_RATE;
 
+#define DEFAULT_SAMPLES_PER_UPDATE 10
+static uint8_t g_samples_per_update = DEFAULT_SAMPLES_PER_UPDATE; // number of samples per call to accel_handler()
+
+// encoding of KEY_SENSOR_DATA, from the phone's Config
+static uint8_t g_codec = CODEC_RAW;
+static uint8_t g_max_error = 0; // CODEC_LOSSY error bound, in mg
+static uint8_t* g_encode_buf = NULL; // encoded samples, allocated (with the size of the outbox) when a codec other than CODEC_RAW is selected
+static uint32_t g_data_bytes_sent = 0; // size of the encoded samples passed to the outbox, for bits per sample
+
+// the encoding of KEY_SENSOR_DATA from each reconfiguration on, so a message that was sent before one, but is
+// acknowledged after it, is counted with the codec it was sent with (see outbox_sent_handler())
+#define CODEC_EPOCHS_MAX 4
+
+typedef struct
+{
+    uint32_t offset; // KEY_SENSOR_OFFSET of the first sample with this encoding
+    uint8_t codec;
+    uint8_t sample_bytes;
+} CodecEpoch;
+
+static CodecEpoch g_codec_epochs[CODEC_EPOCHS_MAX] = { { .offset = 0, .codec = CODEC_RAW, .sample_bytes = 3 * sizeof(int16_t) } };
+static int g_codec_epoch_count = 1;
+
+// a Config sent by the phone while recording, waiting to be applied at the next sample boundary (see apply_pending_config())
+static Config g_pending_config;
+static bool g_config_pending = false;
+static int g_config_wait = 0; // messages sent while g_pending_config has been waiting
+
+// a Config can't wait forever for the buffers to empty; after this many messages, new samples are dropped until they do
+#define RECONFIG_WAIT_MAX 20
+static ReconfigMarker g_reconfig_marker; // sent while the KEY_RECONFIG message flag is set
+
 static AppTimer* g_data_timer = NULL; // sends data to phone at regular intervals
 
 // This interval must be short enough that sensor data will fit in one message (about 656 bytes)
@@ -106,58 +193,78 @@ static AppTimer* g_data_timer = NULL; // sends data to phone at regular interval
 
 static time_t g_last_message_time = 0;
 
-#define PROTOCOL_VERSION 3
+static int g_inbox_size = 0;
+static int g_outbox_size = 0;
+static size_t g_heap_free_at_startup = 0;
+
 static uint16_t g_app_version = 0;
 
 
 static void accel_handler(AccelData* inData, uint32_t inCount);
+static Config current_config();
+static void apply_config(const Config* config);
+static void apply_pending_config();
+static int reserve_samples(int count);
+static int limit_samples(int count);
+static bool sample_limit_reached();
+static void stop_recording();
+static void record_samples(const AccelData* data, int count);
+static void end_segment();
+static void set_motion_rate();
+static void start_benchmark_timer();
+static int write_metadata(uint8_t* buf, int size);
 static void set_connected(bool connected);
 
 ////////////////////////////////////////
-// message keys
-
-// 0x46 0x4D = ascii "FM"
-
-enum
+// bulk download
+// The phone can push blobs (e.g. recognizer templates or filter coefficients) to the watch.
+// Each blob is stored in a slot in persistent storage, one chunk per key, along with a BlobEntry
+// that records its hash and how many chunks have been received, so an interrupted download
+// resumes where it left off, and a blob that hasn't changed is never sent again.
+//
+//   phone: KEY_BLOB_BEGIN
+//   watch: KEY_BLOB_ACK, with the index of the first chunk it still needs
+//   phone: KEY_BLOB_CHUNK, starting at that index
+//   watch: KEY_BLOB_ACK after each chunk, until the status is BLOB_STATUS_COMPLETE
+//
+// An app has about 4 KB of persistent storage in all, so the blobs in all the slots together are limited
+// to BLOB_STORAGE_MAX bytes, which leaves the rest for the app; a blob that doesn't fit is refused.
+
+#define BLOB_SLOTS 4
+#define BLOB_STORAGE_MAX 3072 // bytes, for all slots
+#define BLOB_MAX_CHUNKS (BLOB_STORAGE_MAX / BLOB_CHUNK_SIZE)
+
+// persistent storage keys, with the same "FM" prefix as the message keys
+#define BLOB_PERSIST_KEY(slot, index) (0x464d0000 + (slot) * (BLOB_MAX_CHUNKS + 1) + (index))
+#define BLOB_ENTRY_PERSIST_KEY(slot) BLOB_PERSIST_KEY(slot, BLOB_MAX_CHUNKS)
+
+// stored in persistent storage for each slot
+typedef struct __attribute__ ((__packed__))
 {
-    KEYS_BEGIN = 0x464d0000-1,
-
-    // sent from phone to start recording on watch,
-    // or sent from watch to notify phone that recording was initiated on watch
-    KEY_START,
-
-    // sent from phone to stop recording on watch,
-    // and also sent from watch to notify phone that recording has completed and all data has been sent
-    KEY_STOP,
-
-    // sensor data sent from watch
-    KEY_SENSOR_DATA,
-
-    // metadata sent from watch
-    KEY_METADATA,
-
-    // index of sensor data
-    KEY_SENSOR_OFFSET,
-
-    // sent from phone to try to connect (with app and protocol version)
-    // or sent from watch to confirm connection (with connection id)
-    KEY_CONNECT,
-
-    // sent from phone or watch to disconnect
-    KEY_DISCONNECT,
+    uint32_t hash;
+    uint16_t size;
+    uint8_t chunks_received;
+} BlobEntry;
 
-    // indicates that the containing message was resent
-    KEY_RESEND,
+// acknowledgements waiting to be sent, oldest first; at most one per slot, since a newer one supersedes it
+// (plus one for a message with a bad slot)
+#define BLOB_ACKS_MAX (BLOB_SLOTS + 1)
+static BlobAck g_blob_acks[BLOB_ACKS_MAX];
+static int g_blob_ack_count = 0;
 
-    // sampling rate of sensor data
-    KEY_SENSOR_RATE,
 
-    // periodic message to detect disconnection
-    KEY_HEARTBEAT,
+////////////////////////////////////////
+// benchmark
+// In benchmark mode, samples are generated by a timer rather than read from the accelerometer,
+// at rates that can be well above the accelerometer's maximum, and sent just like real samples
+// (see focusmotion_protocol.h for the pattern).
 
+#define BENCHMARK_TIMER_MS 20
 
-    KEYS_END // insert new values BEFORE this
-};
+static bool g_benchmarking = false; // true while a benchmark recording is in progress
+static uint16_t g_benchmark_rate = 0; // samples per second
+static uint32_t g_benchmark_generated = 0;
+static AppTimer* g_benchmark_timer = NULL;
 
 
 ////////////////////////////////////////
@@ -178,252 +285,1341 @@ static bool get_msg_flag(uint32_t key)
     return g_msg_flags & (1 << (key - KEY_START));
 }
 
-static void clear_resend_buf()
+static uint32_t get_time_ms()
 {
-    for (int i = 0; i < g_resend_buf_count; ++i)
-    {
-        free(g_resend_buf[i].buf);
-    }
-    g_resend_buf_count = 0;
+    time_t seconds;
+    uint16_t ms;
+    time_ms(&seconds, &ms);
+    return (uint32_t) seconds * 1000 + ms;
 }
 
 ////////////////////////////////////////
-
-// all messages are sent from this function, which is triggered at regular intervals by a timer
-static void send_data()
+// profiling
+// With profiling enabled, the hot paths below count their calls and accumulate their running time;
+// when a recording stops, one line per path is logged as JSON:
+//   FMP,{"fn":"<path>","variant":"<kernel variant>","calls":n,"total_ms":n,"max_ms":n,"mean_us":n,"baseline_us":n,"regression":<bool>}
+// Time is measured with get_time_ms(), the finest clock an app can read.  Each call adds the number of millisecond
+// ticks it spans, so most short calls add 0 and some add 1; over many calls the total is an unbiased estimate of the
+// time spent, so compare totals and means rather than the maximum.
+// The means of the first run are kept in persistent storage as the baseline (or of every run, with
+// FM_PROFILE_SAVE_BASELINE), and a path whose mean is more than PROFILE_REGRESSION_PCT above its baseline is
+// flagged as a regression.
+// Use the wscript's "profile" build profile, which leaves out FM_TRACE and the FM_VERIFY_* checks, so their logging
+// and extra work aren't counted in the timings.
+
+//#define FM_PROFILE_ENABLED 1
+
+#if FM_PROFILE_ENABLED
+
+typedef enum
 {
-    if (g_resend_buf_count > 0)
-    {
-        FM_LOG("resending");
-        MsgBuf msgbuf = g_resend_buf[g_resend_buf_count-1];
-        DictionaryIterator* out_iter;
-        if (app_message_outbox_begin(&out_iter) != APP_MSG_OK)
-        {
-            FM_LOG("resending return 1");
-            return;
-        }
-
-        DictionaryIterator in_iter;
-        Tuple* t = dict_read_begin_from_buffer(&in_iter, msgbuf.buf, msgbuf.size);
-        int resend = -1;
-        while (t)
-        {
-            if (t->key > KEYS_BEGIN && t->key < KEYS_END)
-            {
-                if (t->key == KEY_RESEND)
-                {
-                    resend = t->value[0].uint8;
-                }
-                else
-                {
-                    switch (t->type)
-                    {
-                        // TODO what if there's too much data to fit in this message?
-                        case TUPLE_BYTE_ARRAY: dict_write_data(out_iter, t->key, t->value[0].data, t->length);            break;
-                        case TUPLE_CSTRING:    dict_write_cstring(out_iter, t->key, t->value[0].cstring);                 break;
-                        case TUPLE_UINT:       dict_write_int(out_iter, t->key, &t->value[0].uint32, t->length, false);   break;
-                        case TUPLE_INT:        dict_write_int(out_iter, t->key, &t->value[0].int32, t->length, true);     break;
-                        default: APP_LOG(APP_LOG_LEVEL_DEBUG, "unknown type");
-                    }
-                }
-            }
+    PROFILE_ACCEL,   // accel_handler(), per batch
+    PROFILE_SEND,    // send_data(), per call
+    PROFILE_RESEND,  // dictionary rewrite in the resend path
+    PROFILE_INBOX,   // inbox_received_handler() dispatch
+    PROFILE_COUNT
+} ProfileId;
 
-            t = dict_read_next(&in_iter);
-        }
+typedef struct
+{
+    uint32_t calls;
+    uint32_t total;
+    uint32_t max;
+} ProfileCounter;
 
-        ++resend;
-        dict_write_uint8(out_iter, KEY_RESEND, resend);
+static const char* const k_profile_names[PROFILE_COUNT] = { "accel_handler", "send_data", "resend_rewrite", "inbox_received_handler" };
+static ProfileCounter g_profile[PROFILE_COUNT];
 
-        dict_write_end(out_iter);
+#define PROFILE_BASELINE_PERSIST_KEY 0x464d0100 // with the same "FM" prefix as the blob keys, after them
+#define PROFILE_REGRESSION_PCT 20
 
-        // if message fails to be sent, it will be sent in the next call to this function.
-        if (app_message_outbox_send() == APP_MSG_OK)
-        {
-            free(g_resend_buf[g_resend_buf_count-1].buf);
-            --g_resend_buf_count;
-        }
-        else
-        {
-            FM_LOG("resending return 2");
-        }
-    }
+static uint32_t profile_clock()
+{
+    return get_time_ms();
+}
 
-    if (g_accel_buf_count > 0 || g_msg_flags)
+static void profile_add(ProfileId id, uint32_t start)
+{
+    uint32_t elapsed = profile_clock() - start;
+    ProfileCounter* counter = &g_profile[id];
+    ++counter->calls;
+    counter->total += elapsed;
+    if (elapsed > counter->max)
     {
-//        FM_LOG("sending %d %d", g_accel_buf_count, g_msg_flags);
-        DictionaryIterator* iter;
-        AppMessageResult r;
-        if ((r=app_message_outbox_begin(&iter)) != APP_MSG_OK)
-        {
-            FM_LOG("sending return 1 %d", r);
-            return;
-        }
-
-        if (get_msg_flag(KEY_CONNECT))
-        {
-            uint32_t version = ((g_app_version << 16) | PROTOCOL_VERSION);
-            dict_write_uint32(iter, KEY_CONNECT, g_connected ? (g_connection_id << 16) : version);
-            if (g_connected)
-            {
-                dict_write_data(iter, KEY_METADATA, (const uint8_t*) g_metadata_buf, g_metadata_len);
-            }
-        }
-
-        if (get_msg_flag(KEY_START))
-        {
-            dict_write_uint8(iter, KEY_START, 1);
-        }
-
-        if (get_msg_flag(KEY_HEARTBEAT))
-        {
-            dict_write_uint8(iter, KEY_HEARTBEAT, 1);
-        }
-
-        int samples_to_send = 0;
-        int new_msg_flags = 0;
-
-        if (g_accel_buf_count > 0)
-        {
-            // index of data
-            dict_write_uint32(iter, KEY_SENSOR_OFFSET, g_samples_sent);
-
-            dict_write_uint8(iter, KEY_SENSOR_RATE, g_sampling_rate);
-
-            // sensor data
-            int bytes_available = (uint8_t*) iter->end - (uint8_t*) iter->cursor;
-            bytes_available -= 32; // leave a little extra space in case we need to add RESEND key; also if we don't leave enough, Pebble crashes!
-            int samples_max = bytes_available / sizeof(Sample);
-            samples_to_send = g_accel_buf_count;
-            if (samples_to_send > samples_max)
-            {
-                samples_to_send = samples_max;
-            }
-            dict_write_data(iter, KEY_SENSOR_DATA, (const uint8_t*) g_accel_buf, samples_to_send * sizeof(Sample));
-        }
-
-        // don't stop or disconnect until all samples have been sent
-        if (samples_to_send == g_accel_buf_count)
-        {
-            if (get_msg_flag(KEY_STOP))
-            {
-                int data[] = { g_samples_sent + samples_to_send, g_samples_measured };
-                dict_write_data(iter, KEY_STOP, (const uint8_t*) data, sizeof(data));
-            }
-
-            if (get_msg_flag(KEY_DISCONNECT))
-            {
-                dict_write_uint8(iter, KEY_DISCONNECT, g_connection_id);
-            }
-        }
-        else
-        {
-            new_msg_flags = g_msg_flags & ((1 << (KEY_STOP - KEY_START)) | (1 << (KEY_DISCONNECT - KEY_START)));
-        }
+        counter->max = elapsed;
+    }
+}
 
+static void profile_report()
+{
+    uint32_t baseline[PROFILE_COUNT]; // mean time per call, in microseconds
+    bool has_baseline = persist_read_data(PROFILE_BASELINE_PERSIST_KEY, baseline, sizeof(baseline)) == sizeof(baseline);
 
-        dict_write_end(iter);
+    uint32_t mean_us[PROFILE_COUNT];
+    for (int i = 0; i < PROFILE_COUNT; ++i)
+    {
+        const ProfileCounter* counter = &g_profile[i];
+        mean_us[i] = counter->calls > 0 ? (uint32_t) ((uint64_t) counter->total * 1000 / counter->calls) : 0;
+        bool regression = has_baseline && counter->calls > 0 &&
+                          (uint64_t) mean_us[i] * 100 > (uint64_t) baseline[i] * (100 + PROFILE_REGRESSION_PCT);
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "FMP,{\"fn\":\"%s\",\"variant\":\"%s\",\"calls\":%u,\"total_ms\":%u,\"max_ms\":%u,"
+                "\"mean_us\":%u,\"baseline_us\":%u,\"regression\":%s}",
+                k_profile_names[i], FM_KERNEL_VARIANT,
+                (unsigned) counter->calls, (unsigned) counter->total, (unsigned) counter->max,
+                (unsigned) mean_us[i], (unsigned) (has_baseline ? baseline[i] : mean_us[i]), regression ? "true" : "false");
+    }
 
-        /*
-#if FM_LOG_ENABLED
-        {
-            Tuple* t = dict_read_first(iter);
-            while (t)
-            {
-                if (t->key != KEY_SENSOR_OFFSET && t->key != KEY_SENSOR_RATE && t->key != KEY_SENSOR_DATA)
-                {
-                    FM_LOG("sending key: %x", (int) t->key);
-                    t = dict_read_next(iter);
-                }
-            }
-        }
+#if !FM_PROFILE_SAVE_BASELINE
+    if (!has_baseline)
 #endif
-*/
-
-        // if message fails to be sent, it will be sent in the next call to this function.
-        if (app_message_outbox_send() == APP_MSG_OK)
-        {
-            g_msg_flags = new_msg_flags;
+    {
+        persist_write_data(PROFILE_BASELINE_PERSIST_KEY, mean_us, sizeof(mean_us));
+    }
+    memset(g_profile, 0, sizeof(g_profile));
+}
 
-            if (samples_to_send > 0)
-            {
-                if (samples_to_send < g_accel_buf_count)
-                {
-                    memmove(g_accel_buf, g_accel_buf + samples_to_send, (g_accel_buf_count - samples_to_send) * sizeof(Sample));
-                }
-                g_accel_buf_count -= samples_to_send;
-                FM_ASSERT(g_accel_buf_count >= 0);
+#  define FM_PROFILE_BEGIN(id) uint32_t profile_start_##id = profile_clock()
+#  define FM_PROFILE_END(id) profile_add(id, profile_start_##id)
+#  define FM_PROFILE_REPORT() profile_report()
+#else
+#  define FM_PROFILE_BEGIN(id)
+#  define FM_PROFILE_END(id)
+#  define FM_PROFILE_REPORT()
+#endif
 
-                g_samples_sent += samples_to_send;
-            }
-        }
-        else
-        {
-            FM_LOG("sending return 2");
-        }
+// all messages are sent with this function, so we can measure how long delivery takes
+static AppMessageResult outbox_send()
+{
+    AppMessageResult r = app_message_outbox_send();
+    FM_TRACE("send", r, g_accel_buf_count);
+    if (r == APP_MSG_OK)
+    {
+        g_outbox_send_ms = get_time_ms();
+        ++g_stats.messages_sent;
     }
+    return r;
 }
 
+static int sample_bytes()
+{
+    return g_sample_channels * sizeof(int16_t);
+}
 
+static int16_t* sample_at(int index)
+{
+    return g_accel_buf + index * g_sample_channels;
+}
 
-////////////////////////////////////////
-// data timer
+// index where the next sample should be stored
+static int accel_buf_end()
+{
+    int i = g_accel_buf_start + g_accel_buf_count;
+    return i < g_accel_buf_size ? i : i - g_accel_buf_size;
+}
 
-static void data_timer_callback(void*);
+static void pack_samples(int16_t* out, const AccelData* in, int count)
+{
+    if (g_channels == CHANNELS_XYZ)
+    {
+        fm_pack_samples((Sample*) out, in, count);
+    }
+    else
+    {
+        fm_pack_channels(out, in, count, g_channels);
+    }
+}
 
-static void register_data_timer()
+// stores count accelerometer readings, which must fit, after the last sample in the buffer
+static void store_samples(const AccelData* in, int count)
 {
-    if (!g_data_timer)
+    // the free space may wrap around the end of the ring buffer
+    int end = accel_buf_end();
+    int n1 = g_accel_buf_size - end;
+    if (n1 > count)
     {
-        g_data_timer = app_timer_register(DATA_TIMER_MS, data_timer_callback, NULL);
+        n1 = count;
     }
+    pack_samples(sample_at(end), in, n1);
+    pack_samples(g_accel_buf, in + n1, count - n1);
+    g_accel_buf_count += count;
 }
 
-static void cancel_data_timer()
+// number of samples in a KEY_SENSOR_DATA value with the given encoding
+static int data_sample_count(const uint8_t* data, int size, const CodecEpoch* epoch)
 {
-    if (g_data_timer)
+    switch (epoch->codec)
     {
-        app_timer_cancel(g_data_timer);
+        case CODEC_LOSSY:    return size >= LOSSY_HEADER_SIZE ? data[1] | (data[2] << 8) : 0;
+        case CODEC_PACKED40: return size / PACKED40_SAMPLE_SIZE;
+        default:             return size / epoch->sample_bytes;
     }
-    g_data_timer = NULL;
 }
 
-static void data_timer_callback(void* data)
+// the current encoding applies from offset on; the oldest epoch is forgotten when there are too many
+static void add_codec_epoch(uint32_t offset)
 {
-    g_data_timer = NULL;
-    send_data();
+    if (g_codec_epoch_count == CODEC_EPOCHS_MAX)
+    {
+        --g_codec_epoch_count;
+        memmove(g_codec_epochs, g_codec_epochs + 1, g_codec_epoch_count * sizeof(CodecEpoch));
+    }
+    g_codec_epochs[g_codec_epoch_count++] = (CodecEpoch) { .offset = offset, .codec = g_codec, .sample_bytes = sample_bytes() };
+}
 
-    if (g_last_message_time > 0)
+// the encoding of the samples starting at offset
+static const CodecEpoch* find_codec_epoch(uint32_t offset)
+{
+    int i = g_codec_epoch_count - 1;
+    while (i > 0 && g_codec_epochs[i].offset > offset)
     {
-        time_t d = time(NULL) - g_last_message_time;
-        if (g_connected && d > 8)
-        {
-            FM_LOG("timeout!");
-            set_connected(false);
-        }
+        --i;
     }
+    return &g_codec_epochs[i];
+}
 
-    register_data_timer();
+// true once a Config has waited RECONFIG_WAIT_MAX messages to be applied; new values are then dropped, so the buffers drain
+static bool config_overdue()
+{
+    return g_config_pending && g_recording && g_config_wait >= RECONFIG_WAIT_MAX;
 }
 
+static void clear_accel_buf()
+{
+    g_accel_buf_start = 0;
+    g_accel_buf_count = 0;
+    g_gap_count = 0;
+    g_samples_skipped = 0;
+}
 
 ////////////////////////////////////////
-// start/stop recording
+// sensor streams
+// Other sensors are read once per accelerometer batch, into small ring buffers, and sent in frames with the
+// accelerometer data.  When a stream's buffer is full, its oldest values are dropped.
 
-static void start_recording()
+#define STREAM_COUNT 2 // framed streams, STREAM_COMPASS and up
+#define STREAM_BUF_SIZE 32 // values per stream
+#define TUPLE_HEADER_SIZE 7 // key, type and length of a dictionary tuple
+
+typedef struct
 {
-    if (!g_recording)
+    int16_t buf[STREAM_BUF_SIZE];
+    int start; // index of the oldest value
+    int count;
+    uint32_t measured; // values read since recording started
+} Stream;
+
+static Stream g_streams[STREAM_COUNT]; // g_streams[i] is stream STREAM_COMPASS + i
+static uint8_t g_stream_mask = 0; // (1 << STREAM_*) for the streams selected by the phone
+static int g_stream_next = 0; // stream whose frame goes first in the next message, so they all get a turn when the outbox is short
+
+// (1 << STREAM_*) for the sensors this watch has
+static uint8_t supported_streams()
+{
+    uint8_t streams = 1 << STREAM_ACCEL;
+#if defined(PBL_COMPASS)
+    streams |= 1 << STREAM_COMPASS;
+#endif
+#if defined(PBL_HEALTH)
+    time_t now = time(NULL);
+    if (health_service_metric_accessible(HealthMetricHeartRateBPM, now - SECONDS_PER_MINUTE, now) & HealthServiceAccessibilityMaskAvailable)
     {
-        FM_LOG("starting recording");
-        g_sampling_rate = g_next_sampling_rate;
-        accel_data_service_subscribe(10, accel_handler);
-        accel_service_set_sampling_rate(g_sampling_rate); // must be after subscribe
-        app_comm_set_sniff_interval(SNIFF_INTERVAL_REDUCED);
+        streams |= 1 << STREAM_HEART_RATE;
+    }
+#endif
+    return streams;
+}
 
-        g_accel_buf_count = 0;
-        g_samples_sent = 0;
-        g_samples_measured = 0;
+static bool stream_selected(int stream)
+{
+    return g_stream_mask & (1 << stream);
+}
 
-        set_msg_flag(KEY_START);
+static int16_t read_stream_value(int stream)
+{
+    switch (stream)
+    {
+#if defined(PBL_COMPASS)
+        case STREAM_COMPASS:
+            {
+                CompassHeadingData data;
+                if (compass_service_peek(&data) == 0 && data.compass_status != CompassStatusDataInvalid)
+                {
+                    return (int16_t) data.magnetic_heading; // wraps to the signed angle
+                }
+            }
+            break;
+#endif
+
+#if defined(PBL_HEALTH)
+        case STREAM_HEART_RATE:
+            {
+                HealthValue bpm = health_service_peek_current_value(HealthMetricHeartRateBPM);
+                if (bpm > 0)
+                {
+                    return bpm;
+                }
+            }
+            break;
+#endif
+
+        default:
+            break;
+    }
+    return STREAM_VALUE_INVALID;
+}
+
+// reads a value from each selected stream; called once per accelerometer batch
+static void read_streams()
+{
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        if (stream_selected(STREAM_COMPASS + i))
+        {
+            Stream* s = &g_streams[i];
+            if (s->count == STREAM_BUF_SIZE)
+            {
+                s->start = (s->start + 1) % STREAM_BUF_SIZE; // drop the oldest
+                --s->count;
+            }
+            ++s->measured; // frame offsets count dropped values too
+            if (config_overdue())
+            {
+                continue;
+            }
+            s->buf[(s->start + s->count) % STREAM_BUF_SIZE] = read_stream_value(STREAM_COMPASS + i);
+            ++s->count;
+        }
+    }
+}
+
+static bool stream_values_pending()
+{
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        if (g_streams[i].count > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void clear_streams()
+{
+    memset(g_streams, 0, sizeof(g_streams));
+}
+
+////////////////////////////////////////
+// accelerometer subscription
+// While armed, the accelerometer stays subscribed between recordings, and the last few samples are kept as a
+// pre-roll, which becomes the start of the next recording.  Between recordings it runs at a low rate, in large
+// batches, to save battery; the pre-roll is sent in its own messages, with its own KEY_SENSOR_RATE.
+
+#define PREROLL_MAX 32
+#define ARMED_SAMPLING_RATE ACCEL_SAMPLING_10HZ
+#define ARMED_SAMPLES_PER_UPDATE 10 // wakes up once a second
+
+static uint8_t g_subscribed_batch = 0; // batch size of the accelerometer subscription, or 0 if not subscribed
+static uint32_t g_last_reading_ms = 0; // time of the latest reading delivered to accel_handler()
+static bool g_armed = false;
+static Sample g_preroll[PREROLL_MAX]; // ring of the latest samples while armed
+static int g_preroll_size = 0; // samples to keep
+static int g_preroll_start = 0;
+static int g_preroll_count = 0;
+static AccelSamplingRate g_preroll_rate = ARMED_SAMPLING_RATE; // rate of the samples in g_preroll
+static int g_preroll_unsent = 0; // pre-roll samples at the front of g_accel_buf, which are sent at g_preroll_rate
+static uint16_t g_preroll_offset = 0; // KEY_PREROLL: offset of the first sample after the start
+static bool g_first_batch_pending = false; // for the start latency
+
+// subscribes with the recording's batch size and sampling rate, or with the armed ones between recordings,
+// unless already subscribed with that batch size
+static void subscribe_accel(bool recording)
+{
+    uint8_t batch = recording ? g_samples_per_update : ARMED_SAMPLES_PER_UPDATE;
+    AccelSamplingRate rate = recording || g_sampling_rate < ARMED_SAMPLING_RATE ? g_sampling_rate : ARMED_SAMPLING_RATE;
+    if (g_subscribed_batch != batch)
+    {
+        if (g_subscribed_batch)
+        {
+            accel_data_service_unsubscribe(); // the batch size can only be changed by subscribing again
+        }
+        accel_data_service_subscribe(batch, accel_handler);
+        g_subscribed_batch = batch;
+    }
+    accel_service_set_sampling_rate(rate); // must be after subscribe
+    if (!recording)
+    {
+        g_preroll_rate = rate;
+    }
+}
+
+// readings taken at the given rate since the last batch was delivered; unsubscribing discards them
+static int undelivered_readings(AccelSamplingRate rate)
+{
+    uint32_t missing = (get_time_ms() - g_last_reading_ms) * rate / 1000;
+    return missing < g_subscribed_batch ? (int) missing : g_subscribed_batch; // no more than one batch is queued
+}
+
+static void unsubscribe_accel()
+{
+    if (g_subscribed_batch)
+    {
+        accel_data_service_unsubscribe();
+        g_subscribed_batch = 0;
+    }
+}
+
+static void keep_preroll(const AccelData* data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count && g_preroll_size > 0; ++i)
+    {
+        if (g_preroll_count == g_preroll_size)
+        {
+            g_preroll_start = (g_preroll_start + 1) % g_preroll_size;
+            --g_preroll_count;
+        }
+        g_preroll[(g_preroll_start + g_preroll_count) % g_preroll_size] = (Sample) { .x = data[i].x, .y = data[i].y, .z = data[i].z };
+        ++g_preroll_count;
+    }
+}
+
+#if defined(PBL_COMPASS)
+static void compass_handler(CompassHeadingData heading)
+{
+    // nothing to do; while subscribed, the compass keeps running, so compass_service_peek() has a current heading
+}
+#endif
+
+static void subscribe_streams(bool subscribe)
+{
+#if defined(PBL_COMPASS)
+    if (stream_selected(STREAM_COMPASS))
+    {
+        if (subscribe)
+        {
+            compass_service_subscribe(compass_handler);
+        }
+        else
+        {
+            compass_service_unsubscribe();
+        }
+    }
+#endif
+}
+
+// writes a KEY_STREAM_FRAMES tuple with the pending values of the selected streams, in at most bytes_max bytes,
+// and sets taken[i] to the number of values of g_streams[i] in it.
+// Each stream with data, and the accelerometer if accel_pending, gets an equal share of bytes_max.
+static void write_stream_frames(DictionaryIterator* iter, int bytes_max, bool accel_pending, int* taken)
+{
+    int pending = accel_pending ? 1 : 0;
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        taken[i] = 0;
+        pending += g_streams[i].count > 0 ? 1 : 0;
+    }
+
+    uint8_t frames[STREAM_COUNT * (sizeof(StreamFrameHeader) + STREAM_BUF_SIZE * sizeof(int16_t))];
+    uint8_t* p = frames;
+    int share = (bytes_max - TUPLE_HEADER_SIZE) / (pending > 0 ? pending : 1);
+    int values_max = (share - (int) sizeof(StreamFrameHeader)) / (int) sizeof(int16_t);
+    for (int k = 0; k < STREAM_COUNT && values_max > 0; ++k)
+    {
+        int i = (g_stream_next + k) % STREAM_COUNT;
+        Stream* s = &g_streams[i];
+        if (s->count == 0)
+        {
+            continue;
+        }
+
+        int n = s->count < values_max ? s->count : values_max;
+        StreamFrameHeader header =
+        {
+            .stream = STREAM_COMPASS + i,
+            .codec = STREAM_CODEC_INT16,
+            .period_ms = g_samples_per_update * 1000 / g_sampling_rate,
+            .offset = s->measured - s->count,
+            .count = n,
+        };
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        for (int j = 0; j < n; ++j, p += sizeof(int16_t))
+        {
+            memcpy(p, &s->buf[(s->start + j) % STREAM_BUF_SIZE], sizeof(int16_t));
+        }
+        taken[i] = n;
+    }
+
+    if (p > frames)
+    {
+        if (dict_write_data(iter, KEY_STREAM_FRAMES, frames, p - frames) == DICT_OK)
+        {
+            g_stream_next = (g_stream_next + 1) % STREAM_COUNT;
+        }
+        else
+        {
+            memset(taken, 0, STREAM_COUNT * sizeof(int)); // the values stay queued for the next message
+        }
+    }
+}
+
+// removes the values that were sent by write_stream_frames()
+static void commit_stream_frames(const int* taken)
+{
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        g_streams[i].start = (g_streams[i].start + taken[i]) % STREAM_BUF_SIZE;
+        g_streams[i].count -= taken[i];
+    }
+}
+
+////////////////////////////////////////
+// stroke segments
+// With Config.segment, only the samples within strokes are stored.  The samples between them are recorded as gaps,
+// like dropped samples, so the offsets sent to the phone skip over them; and each stroke's Segment is queued when it
+// ends, and sent once all of its samples have been sent (see focusmotion_protocol.h).
+
+#define SEGMENTS_MAX 8 // MAX_GAPS must be more than this + 1, so every queued stroke can have an idle gap before it
+#define PEN_EVENTS_MAX 4
+
+// a press or release from the watch app, for SEGMENT_MANUAL
+typedef struct
+{
+    uint32_t time_ms;
+    bool down;
+} PenEvent;
+
+static uint8_t g_segment_mode = SEGMENT_NONE;
+static uint8_t g_segment_threshold = 0; // as in Config
+static bool g_pen_down = false; // for SEGMENT_MANUAL, as of the last reading
+static PenEvent g_pen_events[PEN_EVENTS_MAX]; // presses and releases later than the last reading
+static int g_pen_event_count = 0;
+static FmMotionDetector g_motion = { .threshold = SEGMENT_DEFAULT_THRESHOLD }; // for SEGMENT_MOTION
+static bool g_segment_open = false; // in a stroke?
+static uint32_t g_segment_start = 0; // offset of the open stroke's first sample
+static Segment g_segments[SEGMENTS_MAX]; // strokes that have ended, waiting to be sent
+static int g_segment_count = 0;
+
+// sets the readings the motion must stay low for a stroke to end, and how fast the mean it's measured from follows
+// the wrist's orientation (over about a second: 2^shift readings), for the current sampling rate
+static void set_motion_rate()
+{
+    uint8_t shift = 3;
+    while ((1 << shift) < (int) g_sampling_rate)
+    {
+        ++shift;
+    }
+    if (shift != g_motion.filter.shift)
+    {
+        g_motion.filter = (FmFilterState) { .shift = shift };
+    }
+    g_motion.hold = g_sampling_rate * SEGMENT_QUIET_MS / 1000;
+}
+
+static void clear_segments()
+{
+    g_segment_open = false;
+    g_segment_count = 0;
+    set_motion_rate();
+    g_motion.filter.primed = false; // the first reading starts the mean
+    g_motion.quiet = 0;
+    g_motion.moving = false;
+
+    // presses and releases before the start just set the pen's state
+    if (g_pen_event_count > 0)
+    {
+        g_pen_down = g_pen_events[g_pen_event_count-1].down;
+        g_pen_event_count = 0;
+    }
+}
+
+// the pen's state at the time of the reading, applying the presses and releases up to then
+static bool manual_pen_down(const AccelData* reading)
+{
+    while (g_pen_event_count > 0 && (int32_t) ((uint32_t) reading->timestamp - g_pen_events[0].time_ms) >= 0)
+    {
+        g_pen_down = g_pen_events[0].down;
+        --g_pen_event_count;
+        memmove(g_pen_events, g_pen_events + 1, g_pen_event_count * sizeof(PenEvent));
+    }
+    return g_pen_down;
+}
+
+// adds count samples to the gap at index in g_accel_buf, extending the last gap or using at most max_gaps entries;
+// returns false if there's no room
+static bool add_gap(int index, int count, int max_gaps)
+{
+    Gap* last = g_gap_count > 0 ? &g_gaps[g_gap_count-1] : NULL;
+    if (last && last->index == index && last->length + count <= UINT16_MAX)
+    {
+        last->length += count;
+    }
+    else if (g_gap_count < max_gaps)
+    {
+        g_gaps[g_gap_count++] = (Gap) { .index = index, .length = count }; // may follow one at the same index
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// counts count samples between strokes, and leaves a gap for them at the end of the buffer;
+// returns false if there's no room to record another gap.  The last entry in g_gaps is left for reserve_samples(),
+// so once the table is full nothing more is stored until it drains, and the last gap stays at the end of the buffer.
+static bool skip_samples(int count)
+{
+    if (!add_gap(g_accel_buf_count, count, MAX_GAPS - 1))
+    {
+        return false;
+    }
+    g_samples_measured += count;
+    return true;
+}
+
+// stores count samples, or skips them if they're between strokes
+static void record_run(const AccelData* data, int count, bool in_stroke)
+{
+    if (count > 0 && (in_stroke || !skip_samples(count)))
+    {
+        int n = reserve_samples(count);
+        if (n > 0)
+        {
+            store_samples(data, n);
+        }
+        if (!in_stroke)
+        {
+            FM_LOG("gap table full!  stored %d of %d idle samples", n, count);
+            g_stats.idle_samples_stored += n;
+        }
+    }
+}
+
+static bool pen_down(const AccelData* reading)
+{
+    switch (g_segment_mode)
+    {
+        case SEGMENT_MANUAL: return manual_pen_down(reading);
+        case SEGMENT_MOTION: return fm_detect_motion(&g_motion, reading);
+        default:             return true;
+    }
+}
+
+// ends the open stroke and queues its Segment; if the queue is full, the last queued Segment is extended to cover it
+static void end_segment()
+{
+    if (g_segment_count < SEGMENTS_MAX)
+    {
+        g_segments[g_segment_count++] = (Segment) { .offset = g_segment_start, .length = g_samples_measured - g_segment_start };
+        ++g_stats.segments;
+    }
+    else
+    {
+        FM_LOG("segment queue full!  merging stroke");
+        Segment* last = &g_segments[g_segment_count-1];
+        last->length = g_samples_measured - last->offset;
+    }
+    g_segment_open = false;
+}
+
+// stores the samples within strokes and skips the rest, starting and ending strokes as the pen goes down and up
+static void record_samples(const AccelData* data, int count)
+{
+    if (g_segment_mode == SEGMENT_NONE)
+    {
+        record_run(data, count, true);
+        return;
+    }
+
+    int run = 0; // first sample on the current side of the last stroke boundary
+    for (int i = 0; i < count; ++i)
+    {
+        bool down = pen_down(&data[i]);
+        if (down != g_segment_open)
+        {
+            record_run(data + run, i - run, g_segment_open);
+            run = i;
+            if (down)
+            {
+                g_segment_start = g_samples_measured;
+                g_segment_open = true;
+            }
+            else
+            {
+                end_segment();
+            }
+        }
+    }
+    record_run(data + run, count - run, g_segment_open);
+}
+
+// writes a KEY_SEGMENTS tuple with the queued strokes that end by offset (so all of their samples have been sent);
+// returns the number written
+static int write_segments(DictionaryIterator* iter, uint32_t offset)
+{
+    int n = 0;
+    while (n < g_segment_count && g_segments[n].offset + g_segments[n].length <= offset)
+    {
+        ++n;
+    }
+    if (n > 0 && dict_write_data(iter, KEY_SEGMENTS, (const uint8_t*) g_segments, n * sizeof(Segment)) != DICT_OK)
+    {
+        n = 0; // no room; they go in the next message
+    }
+    return n;
+}
+
+// removes the strokes that were sent by write_segments()
+static void commit_segments(int sent)
+{
+    g_segment_count -= sent;
+    memmove(g_segments, g_segments + sent, g_segment_count * sizeof(Segment));
+}
+
+// room to leave in a message for write_segments()
+static int segment_bytes()
+{
+    return g_segment_count > 0 ? TUPLE_HEADER_SIZE + g_segment_count * (int) sizeof(Segment) : 0;
+}
+
+////////////////////////////////////////
+// processing stages (see focusmotion_add_stage()); the app's come first, then the phone's
+
+typedef struct
+{
+    FmStageFunc func;
+    void* state;
+    uint16_t budget_ms;
+    FmStageStats stats;
+} Stage;
+
+static Stage g_stages[STAGES_MAX];
+static int g_stage_count = 0;
+static int g_app_stage_count = 0;
+
+// a stage set by the phone with KEY_STAGES
+typedef struct
+{
+    uint8_t type; // STAGE_*
+    int16_t param[6];
+    FmFilterState filter;
+} PhoneStage;
+
+static PhoneStage g_phone_stages[STAGES_MAX];
+
+static uint16_t run_phone_stage(AccelData* data, uint32_t count, void* state)
+{
+    PhoneStage* s = (PhoneStage*) state;
+    switch (s->type)
+    {
+        case STAGE_REMOVE_GRAVITY: fm_remove_gravity(data, count, &s->filter);              break;
+        case STAGE_LOW_PASS:       fm_low_pass(data, count, &s->filter);                    break;
+        case STAGE_CLIP_DETECT:    return fm_count_clipped(data, count, s->param[0]);
+        case STAGE_CALIBRATE:      fm_calibrate(data, count, &s->param[0], &s->param[3]);   break;
+        default:                                                                            break;
+    }
+    return 0;
+}
+
+// replaces the phone's stages; this takes effect from the next batch, so it can be done while recording
+static void set_phone_stages(const uint8_t* data, int size)
+{
+    g_stage_count = g_app_stage_count;
+    for (int i = 0; (i + 1) * (int) sizeof(StageConfig) <= size && g_stage_count < STAGES_MAX; ++i)
+    {
+        StageConfig config;
+        memcpy(&config, data + i * sizeof(StageConfig), sizeof(StageConfig));
+        if (config.type < STAGE_REMOVE_GRAVITY || config.type > STAGE_CALIBRATE)
+        {
+            continue;
+        }
+
+        // skipped configs don't use a slot, so index the phone's stages by how many have been added
+        PhoneStage* s = &g_phone_stages[g_stage_count - g_app_stage_count];
+        s->type = config.type;
+        memcpy(s->param, config.param, sizeof(s->param));
+        s->filter = (FmFilterState) { .shift = config.shift < 16 ? config.shift : 15, .primed = false };
+        g_stages[g_stage_count++] = (Stage) { .func = run_phone_stage, .state = s, .budget_ms = config.budget_ms };
+    }
+}
+
+static void run_stages(AccelData* data, uint32_t count)
+{
+    for (int i = 0; i < g_stage_count; ++i)
+    {
+        Stage* s = &g_stages[i];
+        uint32_t start = get_time_ms();
+        s->stats.events += s->func(data, count, s->state);
+        uint32_t elapsed = get_time_ms() - start;
+
+        ++s->stats.batches;
+        s->stats.total_ms += elapsed;
+        if (elapsed > s->stats.max_ms)
+        {
+            s->stats.max_ms = elapsed;
+        }
+        if (s->budget_ms > 0 && elapsed > s->budget_ms)
+        {
+            ++s->stats.overruns;
+        }
+    }
+}
+
+static void clear_stage_stats()
+{
+    for (int i = 0; i < g_stage_count; ++i)
+    {
+        memset(&g_stages[i].stats, 0, sizeof(FmStageStats));
+    }
+}
+
+#if FM_TRACE_ENABLED
+static void trace_data(const uint8_t* data, int size)
+{
+    static const char hex[] = "0123456789abcdef";
+    char line[2*32 + 1];
+    for (int i = 0; i < size; i += 32)
+    {
+        int n = (size - i < 32) ? size - i : 32;
+        for (int j = 0; j < n; ++j)
+        {
+            line[2*j] = hex[data[i+j] >> 4];
+            line[2*j+1] = hex[data[i+j] & 0xf];
+        }
+        line[2*n] = 0;
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "FMD,%s", line);
+    }
+}
+#endif
+
+static void clear_resend_buf()
+{
+    for (int i = 0; i < g_resend_buf_count; ++i)
+    {
+        free(g_resend_buf[i].buf);
+    }
+    g_resend_buf_count = 0;
+}
+
+// FNV-1a (see "hashes" in focusmotion_protocol.h)
+static uint32_t hash_bytes(uint32_t hash, const uint8_t* data, int size)
+{
+    for (int i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= HASH_PRIME;
+    }
+    return hash;
+}
+
+
+////////////////////////////////////////
+
+// all messages are sent from this function, which is triggered at regular intervals by a timer
+static void write_and_send_data()
+{
+    if (g_resend_buf_count > 0)
+    {
+        FM_LOG("resending");
+        MsgBuf msgbuf = g_resend_buf[g_resend_buf_count-1];
+        DictionaryIterator* out_iter;
+        if (app_message_outbox_begin(&out_iter) != APP_MSG_OK)
+        {
+            FM_LOG("resending return 1");
+            return;
+        }
+
+        FM_PROFILE_BEGIN(PROFILE_RESEND);
+        DictionaryIterator in_iter;
+        Tuple* t = dict_read_begin_from_buffer(&in_iter, msgbuf.buf, msgbuf.size);
+        int resend = -1;
+        while (t)
+        {
+            if (t->key > KEYS_BEGIN && t->key < KEYS_END)
+            {
+                if (t->key == KEY_RESEND)
+                {
+                    resend = t->value[0].uint8;
+                }
+                else
+                {
+                    // the original message was built in an outbox of the same size, with room left for KEY_RESEND,
+                    // so its tuples always fit.
+                    switch (t->type)
+                    {
+                        case TUPLE_BYTE_ARRAY: dict_write_data(out_iter, t->key, t->value[0].data, t->length);            break;
+                        case TUPLE_CSTRING:    dict_write_cstring(out_iter, t->key, t->value[0].cstring);                 break;
+                        case TUPLE_UINT:       dict_write_int(out_iter, t->key, &t->value[0].uint32, t->length, false);   break;
+                        case TUPLE_INT:        dict_write_int(out_iter, t->key, &t->value[0].int32, t->length, true);     break;
+                        default: APP_LOG(APP_LOG_LEVEL_DEBUG, "unknown type");
+                    }
+                }
+            }
+
+            t = dict_read_next(&in_iter);
+        }
+
+        ++resend;
+        dict_write_uint8(out_iter, KEY_RESEND, resend);
+
+        dict_write_end(out_iter);
+        FM_PROFILE_END(PROFILE_RESEND);
+
+        // if message fails to be sent, it will be sent in the next call to this function.
+        if (outbox_send() == APP_MSG_OK)
+        {
+            free(g_resend_buf[g_resend_buf_count-1].buf);
+            --g_resend_buf_count;
+        }
+        else
+        {
+            FM_LOG("resending return 2");
+        }
+    }
+
+    if (g_accel_buf_count > 0 || stream_values_pending() || (g_config_pending && g_recording) || g_msg_flags)
+    {
+//        FM_LOG("sending %d %d", g_accel_buf_count, g_msg_flags);
+        DictionaryIterator* iter;
+        AppMessageResult r;
+        if ((r=app_message_outbox_begin(&iter)) != APP_MSG_OK)
+        {
+            FM_LOG("sending return 1 %d", r);
+            return;
+        }
+
+        int new_msg_flags = 0; // flags to keep for the next message
+
+        if (get_msg_flag(KEY_CONNECT))
+        {
+            uint32_t version = ((g_app_version << 16) | PROTOCOL_VERSION);
+            dict_write_uint32(iter, KEY_CONNECT, g_connected ? (g_connection_id << 16) : version);
+            if (g_connected)
+            {
+                // the metadata can change while running (e.g. META_STREAMS, when the heart rate monitor becomes
+                // available), so hash it each time, and only send it if the phone's copy is out of date
+                uint8_t metadata[METADATA_MAX_SIZE];
+                int metadata_len = write_metadata(metadata, sizeof(metadata));
+                uint32_t metadata_hash = hash_bytes(HASH_OFFSET_BASIS, metadata, metadata_len);
+                dict_write_uint32(iter, KEY_METADATA_HASH, metadata_hash);
+                if (g_phone_metadata_hash != metadata_hash)
+                {
+                    if (dict_write_data(iter, KEY_METADATA, metadata, metadata_len) != DICT_OK)
+                    {
+                        new_msg_flags |= 1 << (KEY_CONNECT - KEY_START); // send the acknowledgement again, with the metadata
+                    }
+                }
+
+                Config config = current_config();
+                dict_write_data(iter, KEY_CONFIG, (const uint8_t*) &config, sizeof(config));
+            }
+        }
+
+        if (get_msg_flag(KEY_START))
+        {
+            dict_write_uint8(iter, KEY_START, 1);
+            if (g_preroll_offset > 0)
+            {
+                dict_write_uint16(iter, KEY_PREROLL, g_preroll_offset);
+            }
+        }
+
+        if (get_msg_flag(KEY_HEARTBEAT))
+        {
+            dict_write_uint8(iter, KEY_HEARTBEAT, 1);
+        }
+
+        bool blob_ack_sent = false;
+        if (get_msg_flag(KEY_BLOB_ACK) && g_blob_ack_count > 0)
+        {
+            // one per message; the rest go in the following messages
+            dict_write_data(iter, KEY_BLOB_ACK, (const uint8_t*) &g_blob_acks[0], sizeof(BlobAck));
+            blob_ack_sent = true;
+            if (g_blob_ack_count > 1)
+            {
+                new_msg_flags |= 1 << (KEY_BLOB_ACK - KEY_START);
+            }
+        }
+
+        int samples_to_send = 0;
+        int data_size = 0;
+        int stream_values_taken[STREAM_COUNT] = { 0 };
+        int segments_to_send = 0;
+
+        // gaps that have reached the front of the buffer just advance the offset
+        while (g_gap_count > 0 && g_gaps[0].index == 0)
+        {
+            g_samples_skipped += g_gaps[0].length;
+            --g_gap_count;
+            memmove(g_gaps, g_gaps + 1, g_gap_count * sizeof(Gap));
+        }
+
+        // a Config sent while recording takes effect once everything recorded with the old one has been sent
+        if (g_config_pending && g_recording)
+        {
+            if (g_accel_buf_count == 0 && g_gap_count == 0 && !stream_values_pending() && !get_msg_flag(KEY_RECONFIG))
+            {
+                apply_pending_config();
+            }
+            else
+            {
+                ++g_config_wait; // see config_overdue()
+            }
+        }
+        if (get_msg_flag(KEY_RECONFIG))
+        {
+            dict_write_data(iter, KEY_RECONFIG, (const uint8_t*) &g_reconfig_marker, sizeof(g_reconfig_marker));
+        }
+
+        if (stream_values_pending())
+        {
+            // the other sensors go first, so they get their share of a short outbox
+            int bytes_available = (uint8_t*) iter->end - (uint8_t*) iter->cursor - 32 - 16 - segment_bytes(); // see below, and leave room for the offset and rate
+            write_stream_frames(iter, bytes_available, g_accel_buf_count > 0, stream_values_taken);
+        }
+
+        if (g_accel_buf_count > 0)
+        {
+            // index of data, including dropped samples, so the phone can tell where the gaps are
+            dict_write_uint32(iter, KEY_SENSOR_OFFSET, g_samples_sent + g_samples_skipped);
+
+            uint16_t rate = g_benchmarking ? g_benchmark_rate : g_preroll_unsent > 0 ? g_preroll_rate : g_sampling_rate;
+            dict_write_uint16(iter, KEY_SENSOR_RATE, rate);
+
+            // sensor data
+            int bytes_available = (uint8_t*) iter->end - (uint8_t*) iter->cursor;
+            bytes_available -= 32; // leave a little extra space in case we need to add RESEND key; also if we don't leave enough, Pebble crashes!
+            bytes_available -= segment_bytes();
+            samples_to_send = g_accel_buf_count;
+            if (samples_to_send > g_accel_buf_size - g_accel_buf_start)
+            {
+                samples_to_send = g_accel_buf_size - g_accel_buf_start; // wrapped; the rest goes in the next message
+            }
+            if (g_gap_count > 0 && samples_to_send > g_gaps[0].index)
+            {
+                samples_to_send = g_gaps[0].index; // the rest goes in the next message, with a new offset
+            }
+            if (g_preroll_unsent > 0 && samples_to_send > g_preroll_unsent)
+            {
+                samples_to_send = g_preroll_unsent; // the rest goes in the next message, with the recording's rate
+            }
+
+            const Sample* samples = (const Sample*) sample_at(g_accel_buf_start); // only used as Sample with CHANNELS_XYZ
+            const uint8_t* data;
+            if (g_codec == CODEC_LOSSY && g_encode_buf)
+            {
+                // the encoder stops when the message is full
+                samples_to_send = fm_encode_lossy(g_encode_buf, bytes_available, &data_size, samples, samples_to_send, g_max_error);
+#if FM_VERIFY_CODEC
+                FM_ASSERT(fm_verify_lossy(g_encode_buf, data_size, samples, samples_to_send));
+#endif
+                data = g_encode_buf;
+            }
+            else if (g_codec == CODEC_PACKED40 && g_encode_buf)
+            {
+                int samples_max = bytes_available / PACKED40_SAMPLE_SIZE;
+                if (samples_to_send > samples_max)
+                {
+                    samples_to_send = samples_max;
+                }
+                fm_encode_packed40(g_encode_buf, samples, samples_to_send);
+                data_size = samples_to_send * PACKED40_SAMPLE_SIZE;
+                data = g_encode_buf;
+            }
+            else
+            {
+                int samples_max = bytes_available / sample_bytes();
+                if (samples_to_send > samples_max)
+                {
+                    samples_to_send = samples_max;
+                }
+                data_size = samples_to_send * sample_bytes();
+                data = (const uint8_t*) samples;
+            }
+
+            if (dict_write_data(iter, KEY_SENSOR_DATA, data, data_size) != DICT_OK)
+            {
+                samples_to_send = 0; // they stay in the buffer for the next message
+                data_size = 0;
+            }
+        }
+
+        if (g_segment_count > 0)
+        {
+            segments_to_send = write_segments(iter, g_samples_sent + samples_to_send + g_samples_skipped);
+        }
+
+        // don't stop or disconnect until all samples have been sent
+        bool streams_sent = true;
+        for (int i = 0; i < STREAM_COUNT; ++i)
+        {
+            streams_sent = streams_sent && stream_values_taken[i] == g_streams[i].count;
+        }
+        if (samples_to_send == g_accel_buf_count && streams_sent && segments_to_send == g_segment_count)
+        {
+            if (get_msg_flag(KEY_STOP))
+            {
+                int data[] = { g_samples_sent + samples_to_send, g_samples_measured };
+                dict_write_data(iter, KEY_STOP, (const uint8_t*) data, sizeof(data));
+            }
+
+            if (get_msg_flag(KEY_BENCHMARK))
+            {
+                FmStats stats;
+                focusmotion_get_stats(&stats);
+                BenchmarkResult result =
+                {
+                    .rate = g_benchmark_rate,
+                    .elapsed_ms = stats.elapsed_ms,
+                    .samples_measured = stats.samples_measured,
+                    .samples_sent = stats.samples_sent + samples_to_send,
+                    .samples_acked = stats.samples_acked,
+                    .samples_dropped = stats.samples_dropped,
+                    .messages_failed = stats.messages_failed,
+                    .goodput = stats.goodput,
+                    .latency_avg_ms = stats.latency_avg_ms,
+                    .latency_max_ms = stats.latency_max_ms,
+                };
+                dict_write_data(iter, KEY_BENCHMARK, (const uint8_t*) &result, sizeof(result));
+            }
+
+            if (get_msg_flag(KEY_DISCONNECT))
+            {
+                dict_write_uint8(iter, KEY_DISCONNECT, g_connection_id);
+            }
+        }
+        else
+        {
+            new_msg_flags |= g_msg_flags & ((1 << (KEY_STOP - KEY_START)) | (1 << (KEY_BENCHMARK - KEY_START)) | (1 << (KEY_DISCONNECT - KEY_START)));
+        }
+
+
+        dict_write_end(iter);
+
+        /*
+#if FM_LOG_ENABLED
+        {
+            Tuple* t = dict_read_first(iter);
+            while (t)
+            {
+                if (t->key != KEY_SENSOR_OFFSET && t->key != KEY_SENSOR_RATE && t->key != KEY_SENSOR_DATA)
+                {
+                    FM_LOG("sending key: %x", (int) t->key);
+                    t = dict_read_next(iter);
+                }
+            }
+        }
+#endif
+*/
+
+        // if message fails to be sent, it will be sent in the next call to this function.
+        if (outbox_send() == APP_MSG_OK)
+        {
+            g_msg_flags = new_msg_flags;
+            commit_stream_frames(stream_values_taken);
+            commit_segments(segments_to_send);
+            if (blob_ack_sent)
+            {
+                --g_blob_ack_count;
+                memmove(g_blob_acks, g_blob_acks + 1, g_blob_ack_count * sizeof(BlobAck));
+            }
+
+            if (samples_to_send > 0)
+            {
+                g_accel_buf_start += samples_to_send;
+                if (g_accel_buf_start >= g_accel_buf_size)
+                {
+                    g_accel_buf_start -= g_accel_buf_size;
+                }
+                g_accel_buf_count -= samples_to_send;
+                FM_ASSERT(g_accel_buf_count >= 0);
+                if (g_accel_buf_count == 0)
+                {
+                    g_accel_buf_start = 0; // so the next message is less likely to wrap
+                }
+                for (int i = 0; i < g_gap_count; ++i)
+                {
+                    g_gaps[i].index -= samples_to_send;
+                }
+
+                g_samples_sent += samples_to_send;
+                g_data_bytes_sent += data_size;
+                g_preroll_unsent -= g_preroll_unsent < samples_to_send ? g_preroll_unsent : samples_to_send;
+            }
+        }
+        else
+        {
+            FM_LOG("sending return 2");
+        }
+    }
+}
+
+static void send_data()
+{
+    FM_PROFILE_BEGIN(PROFILE_SEND);
+    write_and_send_data();
+    FM_PROFILE_END(PROFILE_SEND);
+}
+
+
+
+////////////////////////////////////////
+// data timer
+
+static void data_timer_callback(void*);
+
+static void register_data_timer()
+{
+    if (!g_data_timer)
+    {
+        g_data_timer = app_timer_register(DATA_TIMER_MS, data_timer_callback, NULL);
+    }
+}
+
+static void cancel_data_timer()
+{
+    if (g_data_timer)
+    {
+        app_timer_cancel(g_data_timer);
+    }
+    g_data_timer = NULL;
+}
+
+static void data_timer_callback(void* data)
+{
+    FM_TRACE("timer", g_accel_buf_count, g_resend_buf_count);
+    g_data_timer = NULL;
+    send_data();
+
+    if (g_last_message_time > 0)
+    {
+        time_t d = time(NULL) - g_last_message_time;
+        if (g_connected && d > 8)
+        {
+            FM_LOG("timeout!");
+            set_connected(false);
+        }
+    }
+
+    register_data_timer();
+}
+
+
+////////////////////////////////////////
+// start/stop recording
+
+// converts a StartLimit to a number of samples at the given rate (0 = no limit)
+static int sample_limit(const StartLimit* limit, uint32_t rate)
+{
+    if (!limit)
+    {
+        return 0;
+    }
+
+    uint32_t samples = limit->samples;
+    if (limit->duration_ms > 0)
+    {
+        uint32_t duration_samples = (uint32_t) ((uint64_t) limit->duration_ms * rate / 1000);
+        if (duration_samples == 0)
+        {
+            duration_samples = 1;
+        }
+        if (samples == 0 || duration_samples < samples)
+        {
+            samples = duration_samples;
+        }
+    }
+    return samples > INT32_MAX ? INT32_MAX : (int) samples;
+}
+
+// limit may be NULL
+static void start_recording(const StartLimit* limit)
+{
+    if (!g_recording)
+    {
+        FM_LOG("starting recording");
+        g_sampling_rate = g_next_sampling_rate;
+
+        clear_accel_buf();
+        clear_streams();
+        clear_stage_stats();
+        clear_segments();
+        g_preroll_unsent = 0;
+        g_preroll_offset = 0;
+
+        // a change sent during the last recording, which ended before it could be applied
+        if (g_config_pending)
+        {
+            apply_config(&g_pending_config);
+            g_config_pending = false;
+        }
+        g_config_wait = 0;
+        g_codec_epoch_count = 0;
+        add_codec_epoch(0);
+        g_samples_sent = 0;
+        g_samples_measured = 0;
+        g_sample_limit = sample_limit(limit, g_benchmarking ? g_benchmark_rate : g_sampling_rate);
+
+        memset(&g_stats, 0, sizeof(g_stats));
+        g_data_bytes_sent = 0;
+        g_latency_total_ms = 0;
+        g_latency_count = 0;
+        g_recording_start_ms = get_time_ms();
+
+        if (g_benchmarking)
+        {
+            g_benchmark_generated = 0;
+            start_benchmark_timer();
+        }
+        else if (g_armed)
+        {
+            // the pre-roll goes first, so the first messages have the samples from just before the start
+            int n = limit_samples(g_preroll_count);
+            for (int i = 0; i < n; ++i)
+            {
+                Sample* s = &g_preroll[(g_preroll_start + i) % g_preroll_size];
+                AccelData data = { .x = s->x, .y = s->y, .z = s->z };
+                run_stages(&data, 1);
+                record_samples(&data, 1);
+            }
+            g_preroll_unsent = g_accel_buf_count; // after the limit, and any that were dropped or skipped
+            g_stats.preroll_samples = g_preroll_unsent;
+
+            // subscribe again, so no armed readings are delivered as recorded ones; the readings since the last armed
+            // batch are discarded, so leave a gap for them between the pre-roll and the recording
+            int missing = n > 0 ? limit_samples(undelivered_readings(g_preroll_rate)) : 0;
+            unsubscribe_accel();
+            if (missing > 0)
+            {
+                skip_samples(missing);
+            }
+            g_preroll_offset = g_samples_measured;
+            g_preroll_count = 0;
+
+            subscribe_accel(true);
+            subscribe_streams(true);
+        }
+        else
+        {
+            // grab one sample right away, so the first message doesn't have to wait for the first batch.
+            // (must be before subscribe; peek fails while the data service is subscribed)
+            AccelData first;
+            if (accel_service_peek(&first) == 0)
+            {
+                FM_TRACE("peek", 1, 0);
+                FM_TRACE_DATA((const uint8_t*) &first, sizeof(first));
+                run_stages(&first, 1);
+                record_samples(&first, 1);
+            }
+
+            subscribe_accel(true);
+            subscribe_streams(true);
+        }
+        g_first_batch_pending = !g_benchmarking;
+        app_comm_set_sniff_interval(SNIFF_INTERVAL_REDUCED);
+
+        set_msg_flag(KEY_START);
         clear_msg_flag(KEY_STOP);
         send_data();
 
@@ -432,6 +1628,11 @@ static void start_recording()
         {
             g_recording_handler(true);
         }
+
+        if (sample_limit_reached())
+        {
+            stop_recording(); // the limit was within the pre-roll
+        }
     }
 }
 
@@ -440,11 +1641,37 @@ static void stop_recording()
     if (g_recording)
     {
         FM_LOG("stopping recording");
+        g_stats.elapsed_ms = get_time_ms() - g_recording_start_ms;
+
+        if (g_segment_open)
+        {
+            end_segment();
+        }
         set_msg_flag(KEY_STOP);
         clear_msg_flag(KEY_START);
+        if (g_benchmarking)
+        {
+            set_msg_flag(KEY_BENCHMARK);
+        }
         send_data();
 
-        accel_data_service_unsubscribe();
+        if (g_benchmarking)
+        {
+            if (g_benchmark_timer)
+            {
+                app_timer_cancel(g_benchmark_timer);
+                g_benchmark_timer = NULL;
+            }
+        }
+        else
+        {
+            subscribe_streams(false);
+        }
+        unsubscribe_accel(); // discards the readings still queued, so none taken while recording go into the pre-roll
+        if (g_armed)
+        {
+            subscribe_accel(false); // keep running for the next recording (a benchmark doesn't use the accelerometer)
+        }
         app_comm_set_sniff_interval(SNIFF_INTERVAL_NORMAL);
 
         g_recording = false;
@@ -452,6 +1679,9 @@ static void stop_recording()
         {
             g_recording_handler(false);
         }
+        g_benchmarking = false; // after the handler, so it can tell that a benchmark stopped
+
+        FM_PROFILE_REPORT();
     }
 }
 
@@ -477,7 +1707,8 @@ static void set_connected(bool connected)
         {
             stop_recording();
             clear_resend_buf();
-            g_accel_buf_count = 0;
+            clear_accel_buf();
+            g_blob_ack_count = 0; // the phone starts its downloads again when it reconnects
             g_msg_flags = 0;
             g_last_message_time = 0;
 
@@ -495,9 +1726,42 @@ static void set_connected(bool connected)
 }
 
 
+// message was delivered.
+static void outbox_sent_handler(DictionaryIterator* iter, void* context)
+{
+    FM_TRACE("sent", dict_size(iter), 0);
+    uint32_t latency = get_time_ms() - g_outbox_send_ms;
+    g_latency_total_ms += latency;
+    ++g_latency_count;
+    if (latency > g_stats.latency_max_ms)
+    {
+        g_stats.latency_max_ms = latency < UINT16_MAX ? latency : UINT16_MAX;
+    }
+
+    Tuple* t = dict_find(iter, KEY_SENSOR_DATA);
+    if (t)
+    {
+        // the message may have been sent before a reconfiguration, so look up the codec it was sent with
+        Tuple* offset = dict_find(iter, KEY_SENSOR_OFFSET);
+        const CodecEpoch* epoch = find_codec_epoch(offset ? offset->value[0].uint32 : UINT32_MAX);
+        g_stats.samples_acked += data_sample_count(t->value[0].data, t->length, epoch);
+        g_stats.bytes_acked += t->length;
+    }
+
+    // when benchmarking, send the next message as soon as the outbox is free, rather than waiting
+    // for the timer, so we measure the capacity of the link; likewise for messages waiting to be re-sent.
+    if (g_benchmarking || g_resend_buf_count > 0 || g_accel_buf_count >= ACCEL_BUF_HIGH_WATER)
+    {
+        send_data();
+    }
+}
+
 // message was sent but was not delivered.
 static void outbox_failed_handler(DictionaryIterator* in_iter, AppMessageResult reason, void* context)
 {
+    FM_TRACE("failed", dict_size(in_iter), reason);
+    ++g_stats.messages_failed;
+
     if (reason == APP_MSG_SEND_REJECTED)
     {
         // on Android, we've been getting this, which is supposed to indicate that the message is being NACK'd on the
@@ -519,12 +1783,12 @@ static void outbox_failed_handler(DictionaryIterator* in_iter, AppMessageResult
         }
         else
         {
-            if (g_resend_buf_count < RESEND_BUF_SIZE)
+            uint32_t size = dict_size(in_iter);
+            uint8_t* buf = (g_resend_buf_count < g_resend_buf_size) ? malloc(size) : NULL;
+            if (buf)
             {
                 FM_LOG(" retrying %d", t ? (int) t->value[0].uint8:0);
                 // copy the message and save it to be re-sent
-                uint32_t size = dict_size(in_iter);
-                uint8_t* buf = malloc(size);
                 memcpy(buf, in_iter->dictionary, size);
                 g_resend_buf[g_resend_buf_count] = (MsgBuf) { .buf = buf, .size = size };
                 ++g_resend_buf_count;
@@ -544,12 +1808,386 @@ static void outbox_failed_handler(DictionaryIterator* in_iter, AppMessageResult
     FM_LOG("message failed end");
 }
 
+////////////////////////////////////////
+// bulk download
+
+static int blob_chunk_count(int size)
+{
+    return (size + BLOB_CHUNK_SIZE - 1) / BLOB_CHUNK_SIZE;
+}
+
+static bool read_blob_entry(uint8_t slot, BlobEntry* entry)
+{
+    return slot < BLOB_SLOTS && persist_read_data(BLOB_ENTRY_PERSIST_KEY(slot), entry, sizeof(BlobEntry)) == sizeof(BlobEntry);
+}
+
+static bool write_blob_entry(uint8_t slot, const BlobEntry* entry)
+{
+    return persist_write_data(BLOB_ENTRY_PERSIST_KEY(slot), entry, sizeof(BlobEntry)) == sizeof(BlobEntry);
+}
+
+static bool is_blob_complete(const BlobEntry* entry)
+{
+    return entry->chunks_received == blob_chunk_count(entry->size);
+}
+
+static uint32_t hash_blob(uint8_t slot, const BlobEntry* entry)
+{
+    uint8_t buf[BLOB_CHUNK_SIZE];
+    uint32_t hash = HASH_OFFSET_BASIS;
+    for (int i = 0; i < entry->chunks_received; ++i)
+    {
+        int size = persist_read_data(BLOB_PERSIST_KEY(slot, i), buf, sizeof(buf));
+        if (size > 0)
+        {
+            hash = hash_bytes(hash, buf, size);
+        }
+    }
+    return hash;
+}
+
+// bytes stored for the blobs in the slots other than slot
+static int blob_storage_used(uint8_t slot)
+{
+    int used = 0;
+    for (int i = 0; i < BLOB_SLOTS; ++i)
+    {
+        BlobEntry entry;
+        if (i != slot && read_blob_entry(i, &entry))
+        {
+            used += entry.size;
+        }
+    }
+    return used;
+}
+
+static void send_blob_ack(uint8_t slot, uint8_t next_index, uint8_t status)
+{
+    FM_LOG("blob ack: %d %d %d", slot, next_index, status);
+    int i = 0;
+    while (i < g_blob_ack_count && g_blob_acks[i].slot != slot)
+    {
+        ++i;
+    }
+    if (i == BLOB_ACKS_MAX)
+    {
+        i = BLOB_ACKS_MAX - 1; // only possible with bad slots; the latest replaces the last
+    }
+    g_blob_acks[i] = (BlobAck) { .slot = slot, .next_index = next_index, .status = status };
+    if (i == g_blob_ack_count)
+    {
+        ++g_blob_ack_count;
+    }
+    set_msg_flag(KEY_BLOB_ACK);
+    send_data();
+}
+
+static void blob_begin(const BlobInfo* info)
+{
+    if (info->slot >= BLOB_SLOTS || info->size > BLOB_STORAGE_MAX - blob_storage_used(info->slot))
+    {
+        send_blob_ack(info->slot, 0, BLOB_STATUS_ERROR);
+        return;
+    }
+
+    BlobEntry entry;
+    if (read_blob_entry(info->slot, &entry) && entry.hash == info->hash && entry.size == info->size)
+    {
+        // we already have some or all of this blob
+        send_blob_ack(info->slot, entry.chunks_received, is_blob_complete(&entry) ? BLOB_STATUS_COMPLETE : BLOB_STATUS_OK);
+        return;
+    }
+
+    // new contents; discard the old ones
+    for (int i = 0; i < BLOB_MAX_CHUNKS; ++i)
+    {
+        if (persist_exists(BLOB_PERSIST_KEY(info->slot, i)))
+        {
+            persist_delete(BLOB_PERSIST_KEY(info->slot, i));
+        }
+    }
+
+    entry = (BlobEntry) { .hash = info->hash, .size = info->size, .chunks_received = 0 };
+    if (!write_blob_entry(info->slot, &entry))
+    {
+        send_blob_ack(info->slot, 0, BLOB_STATUS_ERROR);
+        return;
+    }
+    send_blob_ack(info->slot, 0, is_blob_complete(&entry) ? BLOB_STATUS_COMPLETE : BLOB_STATUS_OK);
+}
+
+static void blob_chunk(const uint8_t* data, int size)
+{
+    if (size < (int) sizeof(BlobChunkHeader))
+    {
+        return;
+    }
+
+    BlobChunkHeader header;
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    size -= sizeof(header);
+
+    BlobEntry entry;
+    if (!read_blob_entry(header.slot, &entry))
+    {
+        send_blob_ack(header.slot, 0, BLOB_STATUS_ERROR);
+        return;
+    }
+
+    // chunks must arrive in order; if this isn't the one we need, ask for it again
+    int expected_size = entry.size - header.index * BLOB_CHUNK_SIZE;
+    if (expected_size > BLOB_CHUNK_SIZE)
+    {
+        expected_size = BLOB_CHUNK_SIZE;
+    }
+    if (header.index != entry.chunks_received || size != expected_size)
+    {
+        send_blob_ack(header.slot, entry.chunks_received, is_blob_complete(&entry) ? BLOB_STATUS_COMPLETE : BLOB_STATUS_OK);
+        return;
+    }
+
+    if (persist_write_data(BLOB_PERSIST_KEY(header.slot, header.index), data, size) != size)
+    {
+        send_blob_ack(header.slot, entry.chunks_received, BLOB_STATUS_ERROR);
+        return;
+    }
+
+    ++entry.chunks_received;
+    if (is_blob_complete(&entry) && hash_blob(header.slot, &entry) != entry.hash)
+    {
+        FM_LOG("blob hash mismatch");
+        entry.chunks_received = 0;
+        write_blob_entry(header.slot, &entry);
+        send_blob_ack(header.slot, 0, BLOB_STATUS_ERROR);
+        return;
+    }
+    write_blob_entry(header.slot, &entry);
+
+    if (is_blob_complete(&entry))
+    {
+        send_blob_ack(header.slot, entry.chunks_received, BLOB_STATUS_COMPLETE);
+        if (g_blob_handler)
+        {
+            g_blob_handler(header.slot);
+        }
+    }
+    else
+    {
+        send_blob_ack(header.slot, entry.chunks_received, BLOB_STATUS_OK);
+    }
+}
+
+////////////////////////////////////////
+
+// resizes the sample buffer for samples of the given channels, keeping its capacity in samples
+static void set_channels(uint8_t channels)
+{
+    int count = 0;
+    for (uint8_t c = channels; c; c >>= 1)
+    {
+        count += c & 1;
+    }
+    if (channels == g_channels || count == 0)
+    {
+        return;
+    }
+
+    int16_t* buf = realloc(g_accel_buf, g_accel_buf_size * count * sizeof(int16_t));
+    if (buf)
+    {
+        g_accel_buf = buf;
+        g_channels = channels;
+        g_sample_channels = count;
+    }
+}
+
+// apply configuration requested by the phone; unsupported values are ignored,
+// and the applied values are echoed back in the connect acknowledgement.
+// While recording, this must only be done at a sample boundary, when the buffers are empty.
+static void apply_config(const Config* config)
+{
+    switch (config->sampling_rate)
+    {
+        case ACCEL_SAMPLING_10HZ:
+        case ACCEL_SAMPLING_25HZ:
+        case ACCEL_SAMPLING_50HZ:
+        case ACCEL_SAMPLING_100HZ:
+            g_next_sampling_rate = (AccelSamplingRate) config->sampling_rate;
+            if (!g_recording)
+            {
+                g_sampling_rate = g_next_sampling_rate;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    if (config->samples_per_update > 0)
+    {
+        g_samples_per_update = config->samples_per_update;
+    }
+
+    if (g_accel_buf_count == 0)
+    {
+        set_channels(config->channels ? config->channels & CHANNELS_ALL : CHANNELS_XYZ);
+    }
+
+    g_stream_mask = config->streams & supported_streams() & ~(1 << STREAM_ACCEL);
+
+    switch (g_channels == CHANNELS_XYZ ? config->codec : CODEC_RAW) // the other codecs only encode x, y, z
+    {
+        case CODEC_LOSSY:
+        case CODEC_PACKED40:
+            if (!g_encode_buf)
+            {
+                g_encode_buf = malloc(g_outbox_size);
+            }
+            if (g_encode_buf)
+            {
+                g_codec = config->codec;
+                g_max_error = config->codec == CODEC_LOSSY ? config->max_error : 0;
+            }
+            break;
+
+        case CODEC_RAW:
+            g_codec = CODEC_RAW;
+            g_max_error = 0;
+            free(g_encode_buf); // only used while encoding a message, so it can go right away
+            g_encode_buf = NULL;
+            break;
+
+        default:
+            break; // not supported; the echoed Config tells the phone which codec is used
+    }
+
+    if ((config->flags & CONFIG_FLAG_ARM) && !g_armed)
+    {
+        focusmotion_arm(PREROLL_MAX);
+    }
+    else if ((config->flags & CONFIG_FLAG_DISARM) && g_armed)
+    {
+        focusmotion_disarm();
+    }
+
+    uint8_t segment_mode = config->segment <= SEGMENT_MOTION ? config->segment : SEGMENT_NONE;
+    if (segment_mode != g_segment_mode && g_segment_open)
+    {
+        end_segment(); // applied at a sample boundary, so the stroke ends at the last sample sent
+    }
+    g_segment_mode = segment_mode;
+    g_segment_threshold = config->segment_threshold;
+    g_motion.threshold = g_segment_threshold ? g_segment_threshold * SEGMENT_THRESHOLD_UNIT : SEGMENT_DEFAULT_THRESHOLD;
+}
+
+// the configuration in effect, as echoed to the phone
+static Config current_config()
+{
+    return (Config)
+    {
+        .sampling_rate = g_next_sampling_rate,
+        .codec = g_codec,
+        .samples_per_update = g_samples_per_update,
+        .flags = 0,
+        .max_error = g_max_error,
+        .channels = g_channels,
+        .streams = g_stream_mask,
+        .segment = g_segment_mode,
+        .segment_threshold = g_segment_threshold,
+    };
+}
+
+// applies a Config now if not recording; otherwise, at the next sample boundary
+static void set_config(const Config* config)
+{
+    if (g_recording)
+    {
+        g_pending_config = *config; // replaces any earlier change that hasn't been applied yet
+        g_config_pending = true;
+    }
+    else
+    {
+        apply_config(config);
+        if (g_armed)
+        {
+            g_preroll_count = 0; // recorded with the old configuration, as are any readings still queued
+            unsubscribe_accel();
+            subscribe_accel(false);
+        }
+    }
+}
+
+// called from send_data() when everything recorded with the old configuration has been sent;
+// applies g_pending_config to the recording, and queues the marker for the phone
+static void apply_pending_config()
+{
+    if (!g_benchmarking)
+    {
+        subscribe_streams(false); // the streams selected by the old configuration
+    }
+
+    apply_config(&g_pending_config);
+    g_config_pending = false;
+    g_config_wait = 0;
+
+    if (!g_benchmarking)
+    {
+        if (g_next_sampling_rate != g_sampling_rate || g_samples_per_update != g_subscribed_batch)
+        {
+            // subscribe again, so the first batch with the new settings has only readings taken at the new rate;
+            // the readings still queued in the old subscription are discarded, so leave a gap for them
+            int missing = limit_samples(undelivered_readings(g_sampling_rate));
+            unsubscribe_accel();
+            if (missing > 0)
+            {
+                skip_samples(missing);
+            }
+        }
+        g_sampling_rate = g_next_sampling_rate;
+        set_motion_rate();
+        subscribe_accel(true);
+        subscribe_streams(true);
+    }
+
+    // the buffers are empty, so the next sample is at this offset (after any gap above)
+    add_codec_epoch(g_samples_measured);
+    g_reconfig_marker.offset = g_samples_measured;
+    g_reconfig_marker.config = current_config();
+    set_msg_flag(KEY_RECONFIG);
+    FM_TRACE("reconfig", g_reconfig_marker.offset, g_sampling_rate);
+}
+
 // handle incoming messages
 static void inbox_received_handler(DictionaryIterator* iter, void* context)
 {
+    FM_TRACE("inbox", dict_size(iter), 0);
+    FM_TRACE_DATA((const uint8_t*) iter->dictionary, dict_size(iter));
+    FM_PROFILE_BEGIN(PROFILE_INBOX);
+
     g_last_message_time = time(NULL);
 
     bool handled = false;
+    bool acknowledge = false;
+    Config config;
+    bool has_config = false;
+    bool start = false;
+    StartLimit start_limit;
+    bool has_start_limit = false;
+    uint32_t phone_metadata_hash = 0;
+
+    // a phone with another protocol or app version only gets the watch's version back (so it can show a sensible
+    // error message); nothing else in its message is applied
+    Tuple* connect = dict_find(iter, KEY_CONNECT);
+    if (connect && connect->value[0].uint32 > 0 && connect->value[0].uint32 != (((uint32_t) g_app_version << 16) | PROTOCOL_VERSION))
+    {
+        FM_LOG(" protocol version: %d %d", (int) (connect->value[0].uint32 & 0xffff), PROTOCOL_VERSION);
+        FM_LOG(" app version: %d %d", (int) (connect->value[0].uint32 >> 16), g_app_version);
+        set_connected(false);
+        set_msg_flag(KEY_CONNECT);
+        FM_PROFILE_END(PROFILE_INBOX);
+        return;
+    }
 
     Tuple* t = dict_read_first(iter);
 
@@ -560,45 +2198,85 @@ static void inbox_received_handler(DictionaryIterator* iter, void* context)
         {
             case KEY_START:
                 {
-                    start_recording();
-                    handled = true;
+                    if (t->type == TUPLE_BYTE_ARRAY && t->length >= sizeof(StartLimit))
+                    {
+                        memcpy(&start_limit, t->value[0].data, sizeof(start_limit));
+                        has_start_limit = true;
+                    }
+                    start = true; // after the config, which may be in the same message
+                    handled = true;
+                }
+                break;
+
+            case KEY_STOP:
+                stop_recording();
+                handled = true;
+                break;
+
+            case KEY_DISCONNECT:
+                set_connected(false);
+                handled = true;
+                break;
+
+            case KEY_CONNECT:
+                {
+                    uint32_t version = t->value[0].uint32;
+                    if (version > 0)
+                    {
+                        set_connected(true); // a version mismatch was rejected above
+                        set_msg_flag(KEY_CONNECT); // send acknowledgement
+                        acknowledge = true;
+                    }
+                    else
+                    {
+                        set_connected(true);
+                    }
+                }
+                handled = true;
+                break;
+
+            case KEY_STAGES:
+                set_phone_stages(t->value[0].data, t->length);
+                handled = true;
+                break;
+
+            case KEY_CONFIG:
+                if (t->length >= CONFIG_MIN_SIZE)
+                {
+                    // fields added in later protocol versions are zero if the phone doesn't send them
+                    memset(&config, 0, sizeof(Config));
+                    memcpy(&config, t->value[0].data, t->length < sizeof(Config) ? t->length : sizeof(Config));
+                    has_config = true;
                 }
+                handled = true;
                 break;
 
-            case KEY_STOP:
-                stop_recording();
+            case KEY_METADATA_HASH:
+                phone_metadata_hash = t->value[0].uint32;
                 handled = true;
                 break;
 
-            case KEY_DISCONNECT:
-                set_connected(false);
+            case KEY_BLOB_BEGIN:
+                if (t->length >= sizeof(BlobInfo))
+                {
+                    BlobInfo info;
+                    memcpy(&info, t->value[0].data, sizeof(info));
+                    blob_begin(&info);
+                }
                 handled = true;
                 break;
 
-            case KEY_CONNECT:
+            case KEY_BLOB_CHUNK:
+                blob_chunk(t->value[0].data, t->length);
+                handled = true;
+                break;
+
+            case KEY_BENCHMARK:
                 {
-                    uint32_t version = t->value[0].uint32;
-                    if (version > 0)
-                    {
-                        uint16_t protocol_version = (version & 0xffff);
-                        uint16_t app_version = ((version >> 16) & 0xffff);
-                        FM_LOG(" protocol version: %d %d", protocol_version, PROTOCOL_VERSION);
-                        FM_LOG(" app version: %d %d", app_version, g_app_version);
-                        if (protocol_version != PROTOCOL_VERSION || app_version != g_app_version)
-                        {
-                            // protocol version mismatch
-                            set_connected(false);
-                            set_msg_flag(KEY_CONNECT); // will send watch version, so phone can show sensible error message
-                        }
-                        else
-                        {
-                            set_connected(true);
-                            set_msg_flag(KEY_CONNECT); // send acknowledgement
-                        }
-                    }
-                    else
+                    uint16_t rate = (t->length >= 2) ? t->value[0].uint16 : t->value[0].uint8;
+                    if (g_connected && !g_recording)
                     {
-                        set_connected(true);
+                        focusmotion_start_benchmark(rate);
                     }
                 }
                 handled = true;
@@ -611,6 +2289,39 @@ static void inbox_received_handler(DictionaryIterator* iter, void* context)
         t = dict_read_next(iter);
     }
 
+    if (has_config && !acknowledge)
+    {
+        set_config(&config); // e.g. sent with KEY_START, to configure this recording, or to change the current recording
+    }
+
+    if (start)
+    {
+        start_recording(has_start_limit ? &start_limit : NULL);
+    }
+
+    if (acknowledge)
+    {
+        // handshake: reply right away rather than on the next timer tick;
+        // if the phone asked to start, the acknowledgement also carries KEY_START and the first sample.
+        g_phone_metadata_hash = phone_metadata_hash;
+
+        if (has_config)
+        {
+            set_config(&config);
+        }
+
+        if (has_config && (config.flags & CONFIG_FLAG_START))
+        {
+            start_recording(NULL); // sends the message
+        }
+
+        if (get_msg_flag(KEY_CONNECT))
+        {
+            send_data();
+        }
+    }
+    FM_PROFILE_END(PROFILE_INBOX);
+
     // client's handler
     if (!handled && g_inbox_received_handler)
     {
@@ -618,58 +2329,187 @@ static void inbox_received_handler(DictionaryIterator* iter, void* context)
     }
 }
 
-static void accel_handler(AccelData* inData, uint32_t inCount)
+// returns how many of count new samples fit in g_accel_buf; the rest are dropped.
+static int reserve_samples(int count)
 {
-    if (g_recording)
+    g_samples_measured += count;
+
+    int n = count;
+    int nBuf = g_accel_buf_size - g_accel_buf_count;
+    if (g_gap_count == MAX_GAPS)
+    {
+        n = 0; // no room to record another gap, so keep extending the last one until the buffer drains
+    }
+    else if (config_overdue())
+    {
+        n = 0; // let the buffer drain, so the new Config can be applied
+    }
+    else if (n > nBuf)
     {
-        g_samples_measured += inCount;
+        n = nBuf;
+    }
 
-        // store the accelerometer samples
-        int n = inCount;
-        int nBuf = ACCEL_BUF_SIZE - g_accel_buf_count;
-        if (n > nBuf)
+    if (n < count)
+    {
+        // dropping samples!
+        FM_LOG("buffer full!  dropping %d", count-n);
+        g_stats.samples_dropped += count - n;
+
+        if (!add_gap(g_accel_buf_count + n, count - n, MAX_GAPS))
         {
-            FM_LOG("buffer full!  dropping %d", n-nBuf);
-            n = nBuf; // dropping samples!
+            // the table is full, so nothing has been stored since its last gap, which is too long to extend;
+            // the offsets after it will be off by the samples that don't fit
+            FM_LOG("gap overflow!  losing %d", g_gaps[g_gap_count-1].length + count - n - UINT16_MAX);
+            g_gaps[g_gap_count-1].length = UINT16_MAX;
         }
+    }
+    return n;
+}
 
-        if (n > 0)
+// returns how many of count new samples belong to the recording, which ends at g_sample_limit
+static int limit_samples(int count)
+{
+    if (g_sample_limit > 0 && g_samples_measured + count > g_sample_limit)
+    {
+        count = g_sample_limit > g_samples_measured ? g_sample_limit - g_samples_measured : 0;
+    }
+    return count;
+}
+
+static bool sample_limit_reached()
+{
+    return g_sample_limit > 0 && g_samples_measured >= g_sample_limit;
+}
+
+////////////////////////////////////////
+// batch subscribers (see focusmotion_subscribe())
+
+#define MAX_SUBSCRIBERS 4
+
+typedef struct
+{
+    FmBatchHandler handler; // NULL if this slot is free
+    void* context;
+    uint8_t decimation;
+    uint8_t channels;
+    uint16_t phase; // index in the next batch of the subscriber's next reading
+} Subscriber;
+
+static Subscriber g_subscribers[MAX_SUBSCRIBERS];
+
+// passes each subscriber a view of its readings in the batch
+static void notify_subscribers(const AccelData* data, uint32_t count)
+{
+    for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+    {
+        Subscriber* s = &g_subscribers[i];
+        if (s->handler)
         {
-            Sample* pIn = &g_accel_buf[g_accel_buf_count];
-            AccelData* pOut = inData;
-            for (int i = 0; i < n; ++i)
+            FmBatchView view =
             {
-#if 1
-                pIn->x = pOut->x;
-                pIn->y = pOut->y;
-                pIn->z = pOut->z;
-//#ifdef PBL_PLATFORM_DIORITE
-//                // workaround for bug in early release firmware of Pebble 2
-//                pIn-> = -pIn->z;
-//#endif
-#else
-                static int fake = 0;
-                pIn->x = fake;
-                pIn->y = fake;
-                pIn->z = fake;
-                ++fake;
-#endif
-                ++pIn;
-                ++pOut;
+                .data = data,
+                .first = s->phase,
+                .stride = s->decimation,
+                .count = s->phase < count ? (count - s->phase + s->decimation - 1) / s->decimation : 0,
+                .channels = s->channels,
+            };
+            s->phase = view.first + view.count * view.stride - count;
+            if (view.count > 0)
+            {
+                s->handler(&view, s->context);
             }
-            g_accel_buf_count += n;
         }
     }
+}
+
+
+////////////////////////////////////////
+// accelerometer
+
+static void accel_handler(AccelData* inData, uint32_t inCount)
+{
+    FM_TRACE("accel", inCount, 0);
+    FM_TRACE_DATA((const uint8_t*) inData, inCount * sizeof(AccelData));
+    FM_PROFILE_BEGIN(PROFILE_ACCEL);
+    if (inCount > 0)
+    {
+        g_last_reading_ms = (uint32_t) inData[inCount-1].timestamp;
+    }
+    if (g_recording && !g_benchmarking)
+    {
+        if (g_first_batch_pending)
+        {
+            g_stats.start_latency_ms = get_time_ms() - g_recording_start_ms;
+            g_first_batch_pending = false;
+        }
+
+        // the samples up to the limit, if the phone set one
+        int count = limit_samples(inCount);
+        run_stages(inData, count);
+
+        // store the accelerometer samples
+        record_samples(inData, count);
+        read_streams();
+
+        if (sample_limit_reached())
+        {
+            stop_recording(); // sends what's buffered, then KEY_STOP
+        }
+    }
+    else if (g_armed && !g_recording)
+    {
+        keep_preroll(inData, inCount);
+    }
+    FM_PROFILE_END(PROFILE_ACCEL);
 
     if (g_accel_handler)
     {
         // call client's handler
         g_accel_handler(inData, inCount);
     }
+
+    notify_subscribers(inData, inCount);
+}
+
+// generates benchmark samples for the time elapsed since recording started
+static void benchmark_timer_callback(void* data)
+{
+    FM_TRACE("benchmark", g_benchmark_generated, 0);
+    g_benchmark_timer = NULL;
+    if (!g_recording)
+    {
+        return;
+    }
+
+    uint32_t elapsed = get_time_ms() - g_recording_start_ms;
+    uint32_t target = (uint32_t) ((uint64_t) elapsed * g_benchmark_rate / 1000);
+    int count = limit_samples(target - g_benchmark_generated);
+
+    int n = reserve_samples(count);
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t k = g_benchmark_generated + i;
+        AccelData data = { .x = k, .y = -k, .z = k ^ 0x5555 };
+        store_samples(&data, 1);
+    }
+    g_benchmark_generated += count; // dropped samples are still counted, so later samples keep their values
+
+    if (sample_limit_reached())
+    {
+        stop_recording();
+        return;
+    }
+    start_benchmark_timer();
+}
+
+static void start_benchmark_timer()
+{
+    g_benchmark_timer = app_timer_register(BENCHMARK_TIMER_MS, benchmark_timer_callback, NULL);
 }
 
 static void bluetooth_handler(bool connected)
 {
+    FM_TRACE("bluetooth", connected, 0);
     if (!connected)
     {
         set_connected(false);
@@ -685,45 +2525,98 @@ static void bluetooth_handler(bool connected)
 
 ////////////////////////////////////////
 
-void init_metadata()
+static uint8_t* write_metadata_entry(uint8_t* p, uint8_t tag, const void* value, uint8_t length)
+{
+    *p++ = tag;
+    *p++ = length;
+    memcpy(p, value, length);
+    return p + length;
+}
+
+// writes the metadata record into buf, and returns its length
+static int write_metadata(uint8_t* buf, int size)
 {
-    const char* hardwareName = NULL;
-    WatchInfoModel model = watch_info_get_model();
-    switch (model)
+    FM_ASSERT(size >= METADATA_MAX_SIZE);
+
+    extern const PebbleProcessInfo __pbl_app_info;
+    uint8_t* p = buf;
+
+    uint8_t model = watch_info_get_model();
+    p = write_metadata_entry(p, META_HARDWARE_MODEL, &model, sizeof(model));
+
+    uint32_t uuid_hash = hash_bytes(HASH_OFFSET_BASIS, (const uint8_t*) &__pbl_app_info.uuid, sizeof(__pbl_app_info.uuid));
+    p = write_metadata_entry(p, META_APP_UUID_HASH, &uuid_hash, sizeof(uuid_hash));
+
+    uint8_t app_version[] = { __pbl_app_info.process_version.major, __pbl_app_info.process_version.minor };
+    p = write_metadata_entry(p, META_APP_VERSION, app_version, sizeof(app_version));
+
+    uint8_t sdk_version[] = { k_version_major, k_version_minor, k_version_build };
+    p = write_metadata_entry(p, META_SDK_VERSION, sdk_version, sizeof(sdk_version));
+
+    int label_len = strlen(k_version_label);
+    if (label_len > 0)
     {
-        case WATCH_INFO_MODEL_PEBBLE_ORIGINAL:      hardwareName = "Pebble"; break;
-        case WATCH_INFO_MODEL_PEBBLE_STEEL:         hardwareName = "Pebble Steel"; break;
-        case WATCH_INFO_MODEL_PEBBLE_TIME:          hardwareName = "Pebble Time"; break;
-        case WATCH_INFO_MODEL_PEBBLE_TIME_STEEL:    hardwareName = "Pebble Time Steel"; break;
-        case WATCH_INFO_MODEL_PEBBLE_TIME_ROUND_14: hardwareName = "Pebble Time Round 14mm"; break;
-        case WATCH_INFO_MODEL_PEBBLE_TIME_ROUND_20: hardwareName = "Pebble Time Round 20mm"; break;
-        default:
-              {
-                  static char buf[24];
-                  snprintf(buf, sizeof(buf), "Pebble (unknown:%d)", (int)model);
-                  hardwareName = buf;
-              }
+        int label_max = METADATA_MAX_SIZE - (p - buf) - 2 - 16; // leave room for the capability entries below
+        if (label_len > label_max)
+        {
+            label_len = label_max;
+        }
+        p = write_metadata_entry(p, META_SDK_LABEL, k_version_label, label_len);
     }
 
-    extern const PebbleProcessInfo __pbl_app_info;
-    snprintf(g_metadata_buf, sizeof(g_metadata_buf),
-            "{"
-            "\"deviceHardwareName\":\"%s\","
-            "\"deviceAppId\":\"%s (%s)\","
-            "\"deviceAppVersion\":\"%d.%d\","
-            "\"deviceSdkVersion\":\"%d.%d.%d%s%s\""
-            "}",
-            hardwareName,
-            __pbl_app_info.name,
-            __pbl_app_info.company,
-            __pbl_app_info.process_version.major,
-            __pbl_app_info.process_version.minor,
-            k_version_major, k_version_minor, k_version_build, (strlen(k_version_label) ? " " : ""), k_version_label);
-    g_metadata_len = strlen(g_metadata_buf);
+    uint8_t codecs = (1 << CODEC_RAW) | (1 << CODEC_LOSSY) | (1 << CODEC_PACKED40);
+    p = write_metadata_entry(p, META_CODECS, &codecs, sizeof(codecs));
+
+    uint8_t transports = TRANSPORT_APP_MESSAGE;
+    p = write_metadata_entry(p, META_TRANSPORTS, &transports, sizeof(transports));
+
+    uint16_t max_outbox = g_outbox_size;
+    p = write_metadata_entry(p, META_MAX_OUTBOX, &max_outbox, sizeof(max_outbox));
+
+    uint8_t streams = supported_streams();
+    p = write_metadata_entry(p, META_STREAMS, &streams, sizeof(streams));
+
+    FM_ASSERT(p - buf <= METADATA_MAX_SIZE);
+    return p - buf;
 }
 
 ////////////////////////////////////////
 
+static int clamp(int value, int min, int max)
+{
+    return value < min ? min : (value > max ? max : value);
+}
+
+// choose the sizes of the sample, message and resend buffers from the heap available at startup
+static void size_buffers()
+{
+    g_heap_free_at_startup = heap_bytes_free();
+
+    // leave the rest of the heap for the app; aplite has much less to go around
+#ifdef PBL_PLATFORM_APLITE
+    int budget = g_heap_free_at_startup / 3;
+#else
+    int budget = g_heap_free_at_startup / 2;
+#endif
+
+    g_outbox_size = clamp(budget / 4, OUTBOX_MIN, clamp(app_message_outbox_size_maximum(), OUTBOX_MIN, OUTBOX_MAX));
+    g_inbox_size = clamp(budget / 16, INBOX_MIN, clamp(app_message_inbox_size_maximum(), INBOX_MIN, INBOX_MAX));
+    g_accel_buf_size = clamp(budget / 4 / sample_bytes(), ACCEL_BUF_MIN, ACCEL_BUF_MAX);
+    g_resend_buf_size = clamp(budget * 3 / 8 / g_outbox_size, RESEND_BUF_MIN, RESEND_BUF_MAX);
+
+    // sized for the channels in use (CHANNELS_XYZ unless the phone chose others; see set_channels())
+    g_accel_buf = malloc(g_accel_buf_size * sample_bytes());
+    if (!g_accel_buf)
+    {
+        g_accel_buf_size = ACCEL_BUF_MIN;
+        g_accel_buf = malloc(g_accel_buf_size * sample_bytes());
+    }
+    FM_ASSERT(g_accel_buf);
+
+    FM_LOG("buffers: accel %d, inbox %d, outbox %d, resend %d (heap free %d)",
+           g_accel_buf_size, g_inbox_size, g_outbox_size, g_resend_buf_size, (int) g_heap_free_at_startup);
+}
+
 void focusmotion_startup(uint16_t app_version,
                       AppMessageInboxReceived client_inbox_received_handler,
                       AppMessageOutboxFailed client_outbox_failed_handler,
@@ -734,6 +2627,10 @@ void focusmotion_startup(uint16_t app_version,
 {
     if (!g_inited)
     {
+#if FM_TRACE_ENABLED
+        g_trace_start_ms = get_time_ms();
+#endif
+        FM_TRACE("startup", app_version, 0);
         g_app_version = app_version;
         g_inbox_received_handler = client_inbox_received_handler;
         g_outbox_failed_handler = client_outbox_failed_handler;
@@ -742,20 +2639,24 @@ void focusmotion_startup(uint16_t app_version,
         g_recording_handler = client_recording_handler;
         g_connected_handler = client_connected_handler;
 
+        size_buffers();
+
         // message service
         app_message_register_inbox_received(inbox_received_handler);
         app_message_register_outbox_failed(outbox_failed_handler);
+        app_message_register_outbox_sent(outbox_sent_handler);
 //        app_message_open(app_message_inbox_size_maximum(), app_message_outbox_size_maximum()); // TODO don't use maximum size to save memory?
-        app_message_open(3000, 3000);
+        app_message_open(g_inbox_size, g_outbox_size);
         register_data_timer();
 
         // bluetooth service
         bluetooth_connection_service_subscribe(bluetooth_handler);
 
-        // init metadata string
-        init_metadata();
+#if FM_VERIFY_KERNELS
+        FM_ASSERT(fm_verify_kernels());
+#endif
 
-        g_accel_buf_count = 0;
+        clear_accel_buf();
         g_samples_sent = 0;
         g_samples_measured = 0;
         g_msg_flags = 0;
@@ -768,14 +2669,26 @@ void focusmotion_startup(uint16_t app_version,
 
 void focusmotion_start_recording()
 {
+    FM_TRACE("start", 0, 0);
     if (bluetooth_connection_service_peek())
     {
-        start_recording();
+        start_recording(NULL);
+    }
+}
+
+void focusmotion_start_recording_limited(uint32_t samples, uint32_t duration_ms)
+{
+    FM_TRACE("start", samples, duration_ms);
+    if (bluetooth_connection_service_peek())
+    {
+        StartLimit limit = { .samples = samples, .duration_ms = duration_ms };
+        start_recording(&limit);
     }
 }
 
 void focusmotion_stop_recording()
 {
+    FM_TRACE("stop", 0, 0);
     stop_recording();
 }
 
@@ -796,15 +2709,231 @@ AccelSamplingRate focusmotion_get_sampling_rate()
 
 void focusmotion_set_sampling_rate(AccelSamplingRate rate)
 {
-    g_next_sampling_rate = rate;
+    // if recording, the rate changes at the next sample boundary, and the phone is sent a marker
+    Config config = g_config_pending ? g_pending_config : current_config();
+    config.sampling_rate = rate;
+    set_config(&config);
+}
+
+void focusmotion_arm(uint8_t preroll_samples)
+{
+    g_preroll_size = preroll_samples < PREROLL_MAX ? preroll_samples : PREROLL_MAX;
+    g_preroll_start = 0;
+    g_preroll_count = 0;
+    if (!g_armed)
+    {
+        g_armed = true;
+        if (!g_recording)
+        {
+            subscribe_accel(false);
+        }
+    }
+}
+
+void focusmotion_disarm()
+{
+    if (g_armed)
+    {
+        g_armed = false;
+        g_preroll_count = 0;
+        if (!g_recording)
+        {
+            unsubscribe_accel();
+        }
+    }
+}
 
-    // if recording, g_sampling_rate will be set from g_next_sampling_rate
-    // next time we start.
+bool focusmotion_is_armed()
+{
+    return g_armed;
+}
 
-    if (!g_recording)
+void focusmotion_set_pen_down(bool down)
+{
+    FM_TRACE("pen", down, 0);
+    if (g_pen_event_count == PEN_EVENTS_MAX)
+    {
+        // the readings haven't caught up with the oldest yet; apply it now
+        g_pen_down = g_pen_events[0].down;
+        --g_pen_event_count;
+        memmove(g_pen_events, g_pen_events + 1, g_pen_event_count * sizeof(PenEvent));
+    }
+    // applied from the first reading at or after this time, which may be partway through a batch
+    g_pen_events[g_pen_event_count++] = (PenEvent) { .time_ms = get_time_ms(), .down = down };
+}
+
+void focusmotion_start_benchmark(uint16_t rate)
+{
+    FM_TRACE("start_benchmark", rate, 0);
+    if (!g_recording && rate > 0 && bluetooth_connection_service_peek())
+    {
+        g_benchmark_rate = rate;
+        g_benchmarking = true;
+        start_recording(NULL);
+    }
+}
+
+bool focusmotion_is_benchmarking()
+{
+    return g_benchmarking;
+}
+
+void focusmotion_get_stats(FmStats* stats)
+{
+    *stats = g_stats;
+    stats->samples_measured = g_samples_measured;
+    stats->samples_sent = g_samples_sent;
+    if (g_recording)
+    {
+        stats->elapsed_ms = get_time_ms() - g_recording_start_ms;
+    }
+    stats->goodput = stats->elapsed_ms > 0 ? (uint32_t) ((uint64_t) stats->bytes_acked * 1000 / stats->elapsed_ms) : 0;
+    uint32_t latency_avg_ms = g_latency_count > 0 ? g_latency_total_ms / g_latency_count : 0;
+    stats->latency_avg_ms = latency_avg_ms < UINT16_MAX ? latency_avg_ms : UINT16_MAX;
+    stats->bits_per_sample_x100 = g_samples_sent > 0 ? (uint16_t) ((uint64_t) g_data_bytes_sent * 800 / g_samples_sent) : 0;
+}
+
+void focusmotion_get_memory_report(FmMemoryReport* report)
+{
+    int resend_bytes = 0;
+    for (int i = 0; i < g_resend_buf_count; ++i)
+    {
+        resend_bytes += g_resend_buf[i].size;
+    }
+
+    *report = (FmMemoryReport)
+    {
+        .accel_buf_samples = g_accel_buf_size,
+        .accel_buf_bytes = g_accel_buf_size * sample_bytes(),
+        .inbox_bytes = g_inbox_size,
+        .outbox_bytes = g_outbox_size,
+        .resend_buf_messages = g_resend_buf_size,
+        .resend_buf_bytes = resend_bytes,
+        .heap_free_at_startup = g_heap_free_at_startup,
+        .heap_free = heap_bytes_free(),
+    };
+}
+
+void focusmotion_set_blob_handler(FmBlobHandler handler)
+{
+    g_blob_handler = handler;
+}
+
+int focusmotion_add_stage(FmStageFunc func, void* state, uint16_t budget_ms)
+{
+    if (g_stage_count >= STAGES_MAX)
+    {
+        return -1;
+    }
+
+    // the app's stages go before the phone's
+    memmove(&g_stages[g_app_stage_count + 1], &g_stages[g_app_stage_count], (g_stage_count - g_app_stage_count) * sizeof(Stage));
+    g_stages[g_app_stage_count] = (Stage) { .func = func, .state = state, .budget_ms = budget_ms };
+    ++g_stage_count;
+    return g_app_stage_count++;
+}
+
+int focusmotion_get_stage_count()
+{
+    return g_stage_count;
+}
+
+void focusmotion_get_stage_stats(int index, FmStageStats* stats)
+{
+    if (index >= 0 && index < g_stage_count)
+    {
+        *stats = g_stages[index].stats;
+    }
+    else
+    {
+        memset(stats, 0, sizeof(FmStageStats));
+    }
+}
+
+int focusmotion_subscribe(FmBatchHandler handler, uint8_t decimation, uint8_t channels, void* context)
+{
+    for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+    {
+        if (!g_subscribers[i].handler)
+        {
+            g_subscribers[i] = (Subscriber)
+            {
+                .handler = handler,
+                .context = context,
+                .decimation = decimation > 0 ? decimation : 1,
+                .channels = channels,
+                .phase = 0,
+            };
+            return i;
+        }
+    }
+    return -1;
+}
+
+void focusmotion_unsubscribe(int id)
+{
+    if (id >= 0 && id < MAX_SUBSCRIBERS)
+    {
+        g_subscribers[id].handler = NULL;
+    }
+}
+
+int16_t focusmotion_view_get(const FmBatchView* view, int index, FmChannel channel)
+{
+    // only one channel fits in the result, and only the ones the subscriber registered for are offered
+    if (channel == 0 || (channel & (channel - 1)) != 0 || (channel & ~view->channels) != 0)
+    {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "focusmotion_view_get: bad channel 0x%x", (int) channel);
+        return 0;
+    }
+
+    // FmChannel has the same values as CHANNEL_*, so the capture kernel computes derived channels too
+    int16_t value = 0;
+    fm_pack_channels(&value, &view->data[view->first + index * view->stride], 1, channel);
+    return value;
+}
+
+int focusmotion_get_blob_size(uint8_t slot)
+{
+    BlobEntry entry;
+    if (read_blob_entry(slot, &entry) && is_blob_complete(&entry))
+    {
+        return entry.size;
+    }
+    return 0;
+}
+
+int focusmotion_read_blob(uint8_t slot, int offset, uint8_t* buf, int size)
+{
+    int blob_size = focusmotion_get_blob_size(slot);
+    if (offset < 0 || offset >= blob_size)
+    {
+        return 0;
+    }
+    if (size > blob_size - offset)
+    {
+        size = blob_size - offset;
+    }
+
+    uint8_t chunk[BLOB_CHUNK_SIZE];
+    int copied = 0;
+    while (copied < size)
     {
-        g_sampling_rate = rate;
+        int index = (offset + copied) / BLOB_CHUNK_SIZE;
+        int chunk_offset = (offset + copied) % BLOB_CHUNK_SIZE;
+        int n = persist_read_data(BLOB_PERSIST_KEY(slot, index), chunk, sizeof(chunk)) - chunk_offset;
+        if (n <= 0)
+        {
+            break;
+        }
+        if (n > size - copied)
+        {
+            n = size - copied;
+        }
+        memcpy(buf + copied, chunk + chunk_offset, n);
+        copied += n;
     }
+    return copied;
 }
 
 void focusmotion_shutdown()
@@ -816,9 +2945,12 @@ void focusmotion_shutdown()
         g_bluetooth_handler = NULL;
         g_recording_handler = NULL;
         g_connected_handler = NULL;
+        g_blob_handler = NULL;
+        memset(g_subscribers, 0, sizeof(g_subscribers));
 
         set_msg_flag(KEY_DISCONNECT);
         stop_recording();
+        focusmotion_disarm();
         send_data(); // send queued data, e.g. to stop recording
 
         // try sending any last messages
@@ -835,6 +2967,17 @@ void focusmotion_shutdown()
         bluetooth_connection_service_unsubscribe();
         cancel_data_timer();
         clear_resend_buf();
+        free(g_accel_buf);
+        g_accel_buf = NULL;
+        free(g_encode_buf);
+        g_encode_buf = NULL;
+
+        // the next startup sizes its buffers for the default layout
+        g_channels = CHANNELS_XYZ;
+        g_sample_channels = 3;
+        g_codec = CODEC_RAW;
+        g_max_error = 0;
+        g_config_pending = false;
     }
     g_inited = false;
 }
@@ -10,6 +10,82 @@ typedef void (*FmRecordingHandler)(bool is_recording);
 /** Handler to notify your Pebble app when connected to or disconnected from the FocusMotion SDK on the phone */
 typedef void (*FmConnectedHandler)(bool is_connected);
 
+/** Handler to notify your Pebble app when a blob sent from the phone has been completely downloaded */
+typedef void (*FmBlobHandler)(uint8_t slot);
+
+/** Channels of an accelerometer reading, for batch subscribers */
+typedef enum
+{
+    FmChannelX = 0x01,         /**< milli-g */
+    FmChannelY = 0x02,
+    FmChannelZ = 0x04,
+    FmChannelMagnitude = 0x08, /**< length of (x, y, z), in milli-g */
+    FmChannelPitch = 0x10,     /**< rotation about the y axis; 0x10000 = 360 degrees, so -0x8000..0x7fff is -180..180 */
+    FmChannelRoll = 0x20,      /**< rotation about the x axis, in the same units */
+} FmChannel;
+
+/** A read-only view of the readings of one accelerometer batch that a subscriber asked for.
+ The view refers to the batch itself, so it is only valid during the call to the subscriber's handler. */
+typedef struct
+{
+    const AccelData* data; /**< all the readings in the batch */
+    uint16_t first;        /**< index in data of the subscriber's first reading */
+    uint16_t stride;       /**< distance between the subscriber's readings */
+    uint16_t count;        /**< number of readings for the subscriber */
+    uint8_t channels;      /**< FmChannel mask the subscriber registered with */
+} FmBatchView;
+
+/** Handler to receive decimated views of accelerometer batches; see focusmotion_subscribe() */
+typedef void (*FmBatchHandler)(const FmBatchView* view, void* context);
+
+/** A processing stage, which modifies a batch of accelerometer readings in place; see focusmotion_add_stage().
+ Returns the number of events it detected in the batch (e.g. saturated readings), or 0. */
+typedef uint16_t (*FmStageFunc)(AccelData* data, uint32_t count, void* state);
+
+/** Statistics for one processing stage, since recording started */
+typedef struct
+{
+    uint32_t batches;  /**< batches processed */
+    uint32_t total_ms; /**< time spent in the stage */
+    uint16_t max_ms;   /**< longest time for one batch */
+    uint16_t overruns; /**< batches that took longer than the stage's budget */
+    uint32_t events;   /**< sum of the values returned by the stage */
+} FmStageStats;
+
+/** Statistics for the current recording, or the last one if not recording */
+typedef struct
+{
+    uint32_t elapsed_ms;       /**< time since recording started */
+    uint32_t samples_measured; /**< samples read from the accelerometer (or generated, when benchmarking) */
+    uint32_t samples_sent;     /**< samples passed to the outbox */
+    uint32_t samples_acked;    /**< samples acknowledged by the phone */
+    uint32_t samples_dropped;  /**< samples dropped because the buffer was full */
+    uint32_t messages_sent;    /**< messages passed to the outbox */
+    uint32_t messages_failed;  /**< messages that were not delivered (and may have been resent) */
+    uint32_t bytes_acked;      /**< bytes of sample data acknowledged by the phone */
+    uint32_t goodput;          /**< bytes_acked per second */
+    uint16_t latency_avg_ms;   /**< average time from sending a message to its acknowledgement */
+    uint16_t latency_max_ms;   /**< maximum time from sending a message to its acknowledgement */
+    uint16_t bits_per_sample_x100; /**< average size of an encoded three-axis sample, in hundredths of a bit */
+    uint16_t start_latency_ms; /**< time from the start of recording to the first accelerometer batch */
+    uint16_t preroll_samples;  /**< samples recorded from before the recording started, if armed (after any limit and drops) */
+    uint16_t segments;         /**< strokes recorded, if segmenting */
+    uint32_t idle_samples_stored; /**< samples between strokes that were sent anyway, for lack of room to skip them */
+} FmStats;
+
+/** Memory used by the library; buffers are sized at startup according to the heap available on the platform */
+typedef struct
+{
+    uint16_t accel_buf_samples;   /**< capacity of the sample buffer, in samples */
+    uint16_t accel_buf_bytes;     /**< size of the sample buffer */
+    uint16_t inbox_bytes;         /**< size of the AppMessage inbox */
+    uint16_t outbox_bytes;        /**< size of the AppMessage outbox */
+    uint16_t resend_buf_messages; /**< maximum number of undelivered messages kept to be resent */
+    uint16_t resend_buf_bytes;    /**< bytes currently held by undelivered messages */
+    uint32_t heap_free_at_startup;/**< heap_bytes_free() when focusmotion_startup() was called */
+    uint32_t heap_free;           /**< heap_bytes_free() now */
+} FmMemoryReport;
+
 
 /** Call this when your app is initialized; this is typically done from your app's init() function.
 
@@ -38,15 +114,50 @@ void focusmotion_startup(uint16_t app_version,
                          FmRecordingHandler recording_handler);
 
 
+/** Arm the watch: keep the accelerometer running between recordings, and keep the last preroll_samples samples
+ (up to 32), so a recording can start without waiting for the accelerometer, and starts with the samples from just
+ before it was started.  Between recordings it samples at 10 Hz in one-second batches, but this still costs more
+ battery than leaving the accelerometer off. */
+void focusmotion_arm(uint8_t preroll_samples);
+
+/** Stop keeping the accelerometer running between recordings. */
+void focusmotion_disarm();
+
+/** Returns true if the watch is armed. */
+bool focusmotion_is_armed();
+
 /** Start recording sensor data. */
 void focusmotion_start_recording();
 
+/** Start recording sensor data, and stop after the given number of samples or milliseconds (0 for no limit;
+ if both are given, whichever comes first), on exactly that sample. */
+void focusmotion_start_recording_limited(uint32_t samples, uint32_t duration_ms);
+
+/** Mark the pen as down or up, when the phone has configured segmentation by the watch app (SEGMENT_MANUAL):
+ only the samples recorded while it's down are sent, and each stroke is sent to the phone as a segment.
+ For example, call this with true when a button is pressed, and with false when it's released. */
+void focusmotion_set_pen_down(bool down);
+
 /** Stop recording sensor data. */
 void focusmotion_stop_recording();
 
 /** Returns true if sensor data is being recorded. */
 bool focusmotion_is_recording();
 
+/** Start a benchmark recording, which measures the capacity of the link to the phone.
+
+ Rather than reading the accelerometer, samples are generated at the given rate (which may be
+ higher than the accelerometer supports) and sent to the phone as fast as the link allows.
+ Stop it with focusmotion_stop_recording(); the results are available from focusmotion_get_stats(),
+ and are also sent to the phone. */
+void focusmotion_start_benchmark(uint16_t rate);
+
+/** Returns true if a benchmark recording is in progress. */
+bool focusmotion_is_benchmarking();
+
+/** Get statistics for the current recording, or the last one if not recording. */
+void focusmotion_get_stats(FmStats* stats);
+
 /** Returns true if the watch is connected to the FocusMotion SDK on the phone. */
 bool focusmotion_is_connected();
 
@@ -54,8 +165,57 @@ bool focusmotion_is_connected();
 AccelSamplingRate focusmotion_get_sampling_rate();
 
 /** Set the sampling rate of the accelerometer.
- The default sampling rate of the accelerometer is 50 Hz, which is recommended for most types of motion. */
+ The default sampling rate of the accelerometer is 50 Hz, which is recommended for most types of motion.
+ If recording, the recording continues, and the new rate takes effect once the samples already recorded have been sent. */
 void focusmotion_set_sampling_rate(AccelSamplingRate);
 
+/** Get a report of the memory used by the library.
+ Call focusmotion_startup() as late as possible in your app's initialization, since the library sizes its
+ buffers from the heap that is still free at that point. */
+void focusmotion_get_memory_report(FmMemoryReport* report);
+
+/** Set a handler to be notified when a blob sent from the phone has been completely downloaded.
+
+ The phone can send blobs (e.g. recognizer templates or other configuration) to one of a small number
+ of slots.  Blobs are kept in persistent storage, so they are still available the next time your app
+ is launched; the phone only sends a blob again if its contents have changed.  The blobs in all the slots
+ together can take up to 3 KB, which leaves about 1 KB of your app's persistent storage for your app. */
+void focusmotion_set_blob_handler(FmBlobHandler handler);
+
+/** Returns the size in bytes of the blob in the given slot, or 0 if there is no complete blob in that slot. */
+int focusmotion_get_blob_size(uint8_t slot);
+
+/** Copies up to size bytes of the blob in the given slot, starting at offset, into buf.
+ Returns the number of bytes copied. */
+int focusmotion_read_blob(uint8_t slot, int offset, uint8_t* buf, int size);
+
+/** Subscribe to the accelerometer batches the library receives while recording.
+
+ Several subscribers can be registered, each with its own decimation (1 for every reading, 2 for every other
+ reading, and so on, continuing across batches) and FmChannel mask.  They share the library's accelerometer
+ subscription, and are passed views of each batch rather than copies; use focusmotion_view_get() to read them.
+ Returns an id for focusmotion_unsubscribe(), or -1 if there are already too many subscribers. */
+int focusmotion_subscribe(FmBatchHandler handler, uint8_t decimation, uint8_t channels, void* context);
+
+/** Remove a subscriber added with focusmotion_subscribe(). */
+void focusmotion_unsubscribe(int id);
+
+/** Returns the given channel of the index'th reading in a view (index < view->count).
+ channel must be a single FmChannel from the subscriber's mask (view->channels); otherwise it returns 0. */
+int16_t focusmotion_view_get(const FmBatchView* view, int index, FmChannel channel);
+
+/** Add a processing stage, which runs in place on each accelerometer batch while recording, before the readings are
+ stored to be sent.  Stages run in the order they were added, followed by any stages set by the phone; your app's
+ accelerometer handler and subscribers see the processed readings.  A batch that takes longer than budget_ms in the
+ stage (0 for no budget) is counted in its stats.
+ Returns the stage's index, or -1 if there are already too many stages. */
+int focusmotion_add_stage(FmStageFunc func, void* state, uint16_t budget_ms);
+
+/** Returns the number of processing stages, including those set by the phone. */
+int focusmotion_get_stage_count();
+
+/** Get the statistics of the processing stage with the given index. */
+void focusmotion_get_stage_stats(int index, FmStageStats* stats);
+
 /** Call this when your app shuts down; this is typically done from your app's deinit() function. */
 void focusmotion_shutdown();
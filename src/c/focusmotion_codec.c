@@ -0,0 +1,323 @@
+#include "focusmotion_codec.h"
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////////////////////////
+// bit streams (least significant bit first)
+
+typedef struct
+{
+    uint8_t* buf;
+    int size; // bytes
+    int bit;  // bits written
+} BitWriter;
+
+typedef struct
+{
+    const uint8_t* buf;
+    int size; // bytes
+    int bit;  // bits read
+    bool error;
+} BitReader;
+
+static void write_bits(BitWriter* w, uint32_t value, int count)
+{
+    for (int i = 0; i < count; ++i, ++w->bit)
+    {
+        uint8_t* byte = &w->buf[w->bit >> 3];
+        if ((w->bit & 7) == 0)
+        {
+            *byte = 0;
+        }
+        *byte |= ((value >> i) & 1) << (w->bit & 7);
+    }
+}
+
+static uint32_t read_bits(BitReader* r, int count)
+{
+    if (r->bit + count > r->size * 8)
+    {
+        r->error = true;
+        return 0;
+    }
+
+    uint32_t value = 0;
+    for (int i = 0; i < count; ++i, ++r->bit)
+    {
+        value |= (uint32_t) ((r->buf[r->bit >> 3] >> (r->bit & 7)) & 1) << i;
+    }
+    return value;
+}
+
+static int bit_width(uint32_t value)
+{
+    int width = 0;
+    while (value)
+    {
+        ++width;
+        value >>= 1;
+    }
+    return width;
+}
+
+
+////////////////////////////////////////
+// lossy codec
+
+static uint32_t zigzag(int32_t d)
+{
+    return ((uint32_t) d << 1) ^ (uint32_t) (d >> 31);
+}
+
+static int32_t unzigzag(uint32_t z)
+{
+    return (int32_t) (z >> 1) ^ -(int32_t) (z & 1);
+}
+
+// returns n such that n*step is the multiple of step (= 2*max_error + 1) nearest to v
+static int32_t quantize(int32_t v, int step)
+{
+    int32_t a = v + step / 2;
+    return a >= 0 ? a / step : -((-a + step - 1) / step);
+}
+
+static int16_t dequantize(int32_t q, int step)
+{
+    int32_t v = q * step;
+    return v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : (int16_t) v);
+}
+
+static void quantize_sample(const Sample* s, int step, int32_t* q)
+{
+    q[0] = quantize(s->x, step);
+    q[1] = quantize(s->y, step);
+    q[2] = quantize(s->z, step);
+}
+
+int fm_encode_lossy(uint8_t* out, int out_size, int* out_bytes, const Sample* in, int count, uint8_t max_error)
+{
+    *out_bytes = 0;
+    if (count <= 0 || out_size < LOSSY_HEADER_SIZE)
+    {
+        return 0;
+    }
+    if (count > UINT16_MAX)
+    {
+        count = UINT16_MAX;
+    }
+
+    int step = 2 * max_error + 1;
+    int32_t prev[3];
+    quantize_sample(&in[0], step, prev);
+    out[0] = max_error;
+    for (int a = 0; a < 3; ++a)
+    {
+        out[3 + 2*a] = (uint8_t) prev[a];
+        out[4 + 2*a] = (uint8_t) (prev[a] >> 8);
+    }
+
+    BitWriter w = { out + LOSSY_HEADER_SIZE, out_size - LOSSY_HEADER_SIZE, 0 };
+    int encoded = 1;
+    while (encoded < count)
+    {
+        int n = count - encoded;
+        if (n > LOSSY_BLOCK_SIZE)
+        {
+            n = LOSSY_BLOCK_SIZE;
+        }
+
+        // the block's residuals, and the widths that hold the largest of them on each axis
+        uint32_t residual[LOSSY_BLOCK_SIZE][3];
+        int width[3] = { 0, 0, 0 };
+        int32_t q[3] = { prev[0], prev[1], prev[2] };
+        for (int i = 0; i < n; ++i)
+        {
+            int32_t cur[3];
+            quantize_sample(&in[encoded + i], step, cur);
+            for (int a = 0; a < 3; ++a)
+            {
+                residual[i][a] = zigzag(cur[a] - q[a]);
+                int wa = bit_width(residual[i][a]);
+                if (wa > width[a])
+                {
+                    width[a] = wa;
+                }
+                q[a] = cur[a];
+            }
+        }
+
+        int bits = 3 * LOSSY_WIDTH_BITS + n * (width[0] + width[1] + width[2]);
+        if (w.bit + bits > w.size * 8)
+        {
+            break; // the rest goes in the next message
+        }
+
+        for (int a = 0; a < 3; ++a)
+        {
+            write_bits(&w, width[a], LOSSY_WIDTH_BITS);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                write_bits(&w, residual[i][a], width[a]);
+            }
+        }
+
+        memcpy(prev, q, sizeof(prev));
+        encoded += n;
+    }
+
+    out[1] = (uint8_t) encoded;
+    out[2] = (uint8_t) (encoded >> 8);
+    *out_bytes = LOSSY_HEADER_SIZE + (w.bit + 7) / 8;
+    return encoded;
+}
+
+typedef struct
+{
+    BitReader bits;
+    int max_error;
+    int step;
+    int count;
+    int index;
+    int block_left; // samples left in the current block
+    int width[3];
+    int32_t q[3];
+} LossyReader;
+
+static bool lossy_begin(LossyReader* r, const uint8_t* in, int size)
+{
+    if (size < LOSSY_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    r->max_error = in[0];
+    r->step = 2 * in[0] + 1;
+    r->count = in[1] | (in[2] << 8);
+    for (int a = 0; a < 3; ++a)
+    {
+        r->q[a] = (int16_t) (in[3 + 2*a] | (in[4 + 2*a] << 8));
+    }
+    r->bits = (BitReader) { in + LOSSY_HEADER_SIZE, size - LOSSY_HEADER_SIZE, 0, false };
+    r->index = 0;
+    r->block_left = 0;
+    return true;
+}
+
+static bool lossy_next(LossyReader* r, Sample* out)
+{
+    if (r->index >= r->count)
+    {
+        return false;
+    }
+
+    if (r->index > 0)
+    {
+        if (r->block_left == 0)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                r->width[a] = read_bits(&r->bits, LOSSY_WIDTH_BITS);
+            }
+            r->block_left = LOSSY_BLOCK_SIZE;
+        }
+        for (int a = 0; a < 3; ++a)
+        {
+            r->q[a] += unzigzag(read_bits(&r->bits, r->width[a]));
+        }
+        --r->block_left;
+        if (r->bits.error)
+        {
+            return false;
+        }
+    }
+
+    out->x = dequantize(r->q[0], r->step);
+    out->y = dequantize(r->q[1], r->step);
+    out->z = dequantize(r->q[2], r->step);
+    ++r->index;
+    return true;
+}
+
+int fm_decode_lossy(Sample* out, int count_max, const uint8_t* in, int size)
+{
+    LossyReader r;
+    if (!lossy_begin(&r, in, size))
+    {
+        return -1;
+    }
+
+    int n = 0;
+    while (n < count_max && lossy_next(&r, &out[n]))
+    {
+        ++n;
+    }
+    return r.bits.error ? -1 : n;
+}
+
+bool fm_verify_lossy(const uint8_t* in, int size, const Sample* original, int count)
+{
+    LossyReader r;
+    if (!lossy_begin(&r, in, size) || r.count != count)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        Sample s;
+        if (!lossy_next(&r, &s) ||
+            abs(s.x - original[i].x) > r.max_error ||
+            abs(s.y - original[i].y) > r.max_error ||
+            abs(s.z - original[i].z) > r.max_error)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+////////////////////////////////////////
+// packed codec
+
+#define PACKED40_MASK ((1 << PACKED40_BITS) - 1)
+#define PACKED40_MIN (-(1 << (PACKED40_BITS - 1)))
+#define PACKED40_MAX ((1 << (PACKED40_BITS - 1)) - 1)
+
+static uint32_t pack13(int16_t v)
+{
+    int32_t c = v < PACKED40_MIN ? PACKED40_MIN : (v > PACKED40_MAX ? PACKED40_MAX : v);
+    return (uint32_t) c & PACKED40_MASK;
+}
+
+static int16_t unpack13(uint32_t v)
+{
+    return (int16_t) ((int32_t) ((v & PACKED40_MASK) << (32 - PACKED40_BITS)) >> (32 - PACKED40_BITS));
+}
+
+void fm_encode_packed40(uint8_t* out, const Sample* in, int count)
+{
+    for (int i = 0; i < count; ++i, out += PACKED40_SAMPLE_SIZE)
+    {
+        // bits 0-31 in one word, and the top 7 bits of z in the last byte
+        uint32_t z = pack13(in[i].z);
+        uint32_t lo = pack13(in[i].x) | (pack13(in[i].y) << PACKED40_BITS) | (z << (2 * PACKED40_BITS));
+        out[0] = (uint8_t) lo;
+        out[1] = (uint8_t) (lo >> 8);
+        out[2] = (uint8_t) (lo >> 16);
+        out[3] = (uint8_t) (lo >> 24);
+        out[4] = (uint8_t) (z >> (32 - 2 * PACKED40_BITS));
+    }
+}
+
+void fm_decode_packed40(Sample* out, const uint8_t* in, int index)
+{
+    const uint8_t* p = in + index * PACKED40_SAMPLE_SIZE;
+    uint32_t lo = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    out->x = unpack13(lo);
+    out->y = unpack13(lo >> PACKED40_BITS);
+    out->z = unpack13((lo >> (2 * PACKED40_BITS)) | ((uint32_t) p[4] << (32 - 2 * PACKED40_BITS)));
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "focusmotion_protocol.h"
+
+////////////////////////////////////////
+// Sample codecs for KEY_SENSOR_DATA.
+//
+// Like focusmotion_protocol.h, these don't depend on the Pebble SDK, so the decoders can be
+// built into tools that check recorded sessions.  The payload formats are described in
+// focusmotion_protocol.h.
+
+// encodes up to count samples with CODEC_LOSSY into out, which has room for out_size bytes;
+// returns the number of samples encoded (fewer than count if out is full), and sets *out_bytes to the payload size.
+int fm_encode_lossy(uint8_t* out, int out_size, int* out_bytes, const Sample* in, int count, uint8_t max_error);
+
+// decodes a CODEC_LOSSY payload into out, which has room for count_max samples;
+// returns the number of samples decoded, or -1 if the payload is malformed.
+int fm_decode_lossy(Sample* out, int count_max, const uint8_t* in, int size);
+
+// decodes a CODEC_LOSSY payload, without a buffer, and checks that it has count samples,
+// each of which is within the payload's max_error of the corresponding sample in original.
+bool fm_verify_lossy(const uint8_t* in, int size, const Sample* original, int count);
+
+// packs count samples with CODEC_PACKED40 into out, which must have room for count * PACKED40_SAMPLE_SIZE bytes
+void fm_encode_packed40(uint8_t* out, const Sample* in, int count);
+
+// unpacks the sample at index from a CODEC_PACKED40 payload
+void fm_decode_packed40(Sample* out, const uint8_t* in, int index);
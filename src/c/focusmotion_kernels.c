@@ -0,0 +1,256 @@
+#include "focusmotion_kernels.h"
+
+static int16_t saturate16(int32_t v)
+{
+    return v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v);
+}
+
+////////////////////////////////////////
+// sample packing
+
+void fm_pack_samples(Sample* out, const AccelData* in, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        out[i].x = in[i].x;
+        out[i].y = in[i].y;
+        out[i].z = in[i].z;
+    }
+}
+
+
+////////////////////////////////////////
+// channel selection
+
+static uint32_t isqrt(uint32_t v)
+{
+    uint32_t r = 0;
+    uint32_t bit = 1u << 30;
+    while (bit > v)
+    {
+        bit >>= 2;
+    }
+    while (bit)
+    {
+        if (v >= r + bit)
+        {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        }
+        else
+        {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+// sums of squares of the axes, for the magnitude and pitch channels;
+// each square is at most 2^30, so the sums fit in a uint32 (but not always in an int32)
+
+static uint32_t sum_squares_xyz_portable(const AccelData* d)
+{
+    return (uint32_t) (d->x * d->x) + (uint32_t) (d->y * d->y) + (uint32_t) (d->z * d->z);
+}
+
+static uint32_t sum_squares_yz_portable(const AccelData* d)
+{
+    return (uint32_t) (d->y * d->y) + (uint32_t) (d->z * d->z);
+}
+
+#if FM_HAVE_DSP
+
+// x, y and z are adjacent int16s in AccelData, so x and y, or y and z, can be loaded as one word,
+// and SMUAD/SMLAD square both halves and add them in one instruction.  Their results are the
+// sums modulo 2^32, which are exact when read as unsigned.
+
+static inline uint32_t smuad(uint32_t a, uint32_t b)
+{
+    uint32_t r;
+    __asm__ ("smuad %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+
+static inline uint32_t smlad(uint32_t a, uint32_t b, uint32_t acc)
+{
+    uint32_t r;
+    __asm__ ("smlad %0, %1, %2, %3" : "=r" (r) : "r" (a), "r" (b), "r" (acc));
+    return r;
+}
+
+static uint32_t sum_squares_xyz(const AccelData* d)
+{
+    uint32_t xy;
+    memcpy(&xy, &d->x, sizeof(xy));
+    return smlad(xy, xy, (uint32_t) (d->z * d->z));
+}
+
+static uint32_t sum_squares_yz(const AccelData* d)
+{
+    uint32_t yz;
+    memcpy(&yz, &d->y, sizeof(yz));
+    return smuad(yz, yz);
+}
+
+#else
+#  define sum_squares_xyz sum_squares_xyz_portable
+#  define sum_squares_yz sum_squares_yz_portable
+#endif
+
+bool fm_verify_kernels()
+{
+    // every combination of these on the three axes, including the extremes where the sums don't fit in an int32
+    static const int16_t values[] = { 0, 1, -1, 1000, -1000, 4095, -4096, INT16_MAX, INT16_MIN };
+    const int n = sizeof(values) / sizeof(values[0]);
+    for (int i = 0; i < n * n * n; ++i)
+    {
+        AccelData d = { .x = values[i % n], .y = values[i / n % n], .z = values[i / (n * n)] };
+        if (sum_squares_xyz(&d) != sum_squares_xyz_portable(&d) || sum_squares_yz(&d) != sum_squares_yz_portable(&d))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void fm_pack_channels(int16_t* out, const AccelData* in, int count, uint8_t channels)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        int32_t x = in[i].x;
+        int32_t y = in[i].y;
+        int32_t z = in[i].z;
+        if (channels & CHANNEL_X)
+        {
+            *out++ = x;
+        }
+        if (channels & CHANNEL_Y)
+        {
+            *out++ = y;
+        }
+        if (channels & CHANNEL_Z)
+        {
+            *out++ = z;
+        }
+        if (channels & CHANNEL_MAGNITUDE)
+        {
+            *out++ = saturate16(isqrt(sum_squares_xyz(&in[i]))); // up to sqrt(3) * 32768
+        }
+        if (channels & CHANNEL_PITCH)
+        {
+            // atan2_lookup() takes int16s, so halve both arguments if either is out of range (-x can be 32768,
+            // and the length of (y, z) up to 46341), which leaves the angle the same.
+            // It returns 0..TRIG_MAX_ANGLE, which wraps to the signed angle as an int16.
+            int32_t a = -x;
+            int32_t b = isqrt(sum_squares_yz(&in[i]));
+            if (a > INT16_MAX || b > INT16_MAX)
+            {
+                a /= 2;
+                b /= 2;
+            }
+            *out++ = (int16_t) atan2_lookup(a, b);
+        }
+        if (channels & CHANNEL_ROLL)
+        {
+            *out++ = (int16_t) atan2_lookup(y, z);
+        }
+    }
+}
+
+
+////////////////////////////////////////
+// processing stages
+
+// advances the running mean by one reading
+static void update_mean(FmFilterState* state, const AccelData* d)
+{
+    int16_t v[3] = { d->x, d->y, d->z };
+    for (int a = 0; a < 3; ++a)
+    {
+        int32_t q = (int32_t) v[a] * 256; // in 1/256 mg (a left shift of a negative value is undefined)
+        state->mean[a] = state->primed ? state->mean[a] + ((q - state->mean[a]) >> state->shift) : q;
+    }
+    state->primed = true;
+}
+
+void fm_remove_gravity(AccelData* data, int count, FmFilterState* state)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        update_mean(state, &data[i]);
+        data[i].x = saturate16(data[i].x - (state->mean[0] >> 8));
+        data[i].y = saturate16(data[i].y - (state->mean[1] >> 8));
+        data[i].z = saturate16(data[i].z - (state->mean[2] >> 8));
+    }
+}
+
+void fm_low_pass(AccelData* data, int count, FmFilterState* state)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        update_mean(state, &data[i]);
+        data[i].x = state->mean[0] >> 8;
+        data[i].y = state->mean[1] >> 8;
+        data[i].z = state->mean[2] >> 8;
+    }
+}
+
+int fm_count_clipped(const AccelData* data, int count, int16_t threshold)
+{
+    int clipped = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (abs(data[i].x) >= threshold || abs(data[i].y) >= threshold || abs(data[i].z) >= threshold)
+        {
+            ++clipped;
+        }
+    }
+    return clipped;
+}
+
+void fm_calibrate(AccelData* data, int count, const int16_t* offset, const int16_t* scale)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        data[i].x = saturate16(((int32_t) data[i].x + offset[0]) * scale[0] >> 8);
+        data[i].y = saturate16(((int32_t) data[i].y + offset[1]) * scale[1] >> 8);
+        data[i].z = saturate16(((int32_t) data[i].z + offset[2]) * scale[2] >> 8);
+    }
+}
+
+
+////////////////////////////////////////
+// stroke segmentation
+
+bool fm_detect_motion(FmMotionDetector* detector, const AccelData* reading)
+{
+    FmFilterState* filter = &detector->filter;
+    if (!filter->primed)
+    {
+        update_mean(filter, reading);
+        return detector->moving;
+    }
+
+    // measured from the mean before this reading, so the onset isn't diluted by it
+    int32_t level = abs(reading->x - (filter->mean[0] >> 8)) +
+                    abs(reading->y - (filter->mean[1] >> 8)) +
+                    abs(reading->z - (filter->mean[2] >> 8));
+    update_mean(filter, reading);
+
+    if (level >= detector->threshold)
+    {
+        detector->moving = true;
+        detector->quiet = 0;
+    }
+    else if (level >= detector->threshold / 2)
+    {
+        detector->quiet = 0;
+    }
+    else if (detector->moving && ++detector->quiet >= detector->hold)
+    {
+        detector->moving = false;
+        detector->quiet = 0;
+    }
+    return detector->moving;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <pebble.h>
+#include "focusmotion_protocol.h"
+
+////////////////////////////////////////
+// Inner loops of the capture and send paths.
+//
+// The kernels are portable C, except for the sums of squares behind the magnitude and pitch channels in
+// fm_pack_channels(), which have a version for the Cortex-M4 platforms (basalt, chalk, diorite) using the DSP
+// extension's packed 16-bit multiply-accumulate instructions.  The wscript defines FM_HAVE_DSP when building for
+// those platforms.  Both versions must produce identical output; fm_verify_kernels() checks that they do.
+
+#if FM_HAVE_DSP
+#  define FM_KERNEL_VARIANT "m4"
+#else
+#  define FM_KERNEL_VARIANT "portable"
+#endif
+
+// copy count accelerometer readings into packed samples
+void fm_pack_samples(Sample* out, const AccelData* in, int count);
+
+// copy count accelerometer readings into samples of the channels selected in the CHANNEL_* mask
+void fm_pack_channels(int16_t* out, const AccelData* in, int count, uint8_t channels);
+
+// returns true if the FM_HAVE_DSP kernels give the same results as the portable ones on a set of edge cases
+// (always true in a portable build); run at startup when FM_VERIFY_KERNELS is defined
+bool fm_verify_kernels();
+
+// running mean of each axis, in 1/256 mg, for the filter stages
+typedef struct
+{
+    int32_t mean[3];
+    uint8_t shift; // the mean moves 1/2^shift of the way to each reading
+    bool primed; // false until the first reading, which starts the mean
+} FmFilterState;
+
+// subtract the running mean (gravity, and any other slow component) from each reading
+void fm_remove_gravity(AccelData* data, int count, FmFilterState* state);
+
+// replace each reading by the running mean
+void fm_low_pass(AccelData* data, int count, FmFilterState* state);
+
+// returns the number of readings with an axis at or beyond +/-threshold
+int fm_count_clipped(const AccelData* data, int count, int16_t threshold);
+
+// v' = (v + offset) * scale / 256, for each axis
+void fm_calibrate(AccelData* data, int count, const int16_t* offset, const int16_t* scale);
+
+// motion onset/offset detector for stroke segmentation (SEGMENT_MOTION)
+typedef struct
+{
+    FmFilterState filter; // the slow mean the motion is measured from
+    uint16_t threshold; // level that starts a stroke: the sum of each axis's distance from the mean, in mg
+    uint16_t hold; // a stroke ends once the level has stayed below threshold / 2 for this many readings
+    uint16_t quiet; // readings below threshold / 2 so far
+    bool moving;
+} FmMotionDetector;
+
+// updates the detector with the next reading; returns true if the reading is part of a stroke
+bool fm_detect_motion(FmMotionDetector* detector, const AccelData* reading);
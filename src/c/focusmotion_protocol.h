@@ -0,0 +1,392 @@
+#pragma once
+
+/** @file
+ Wire protocol between the focusmotion library on the watch and the FocusMotion SDK on the phone.
+
+ This header does not depend on the Pebble SDK, so the same definitions can be used by code that
+ decodes the messages elsewhere.  Messages are AppMessage dictionaries using the KEY_* keys below;
+ byte array values are the packed, little-endian structs below, so a decoder can read them in place
+ from the received buffer without copying.
+
+ A message containing sensor data has:
+   KEY_SENSOR_OFFSET  uint32    index of its first sample since recording started; each message continues where
+                                the previous one left off, unless samples were dropped on the watch (because
+                                its buffer was full), in which case the offset skips over them
+   KEY_SENSOR_RATE    uint16    sampling rate in Hz (the generated rate, in a benchmark; uint8 before protocol version 15)
+   KEY_SENSOR_DATA    Sample[]  (or the channels selected in Config, or another encoding of the samples, if a CODEC_*
+                                other than CODEC_RAW was configured)
+   KEY_RESEND         uint8     (only if resent) number of times this message has been resent; a resent message
+                                may arrive after later ones, so decoders should place samples by offset
+ KEY_STOP from the watch is int32[2]: { samples sent, samples measured }. */
+
+#include <stdint.h>
+
+#define PROTOCOL_VERSION 15 // 4: binary metadata record; 5: KEY_SENSOR_OFFSET counts dropped samples; 6: lossy codec; 7: packed codec; 8: channels; 9: streams; 10: stages; 11: live reconfiguration; 12: pre-roll; 13: bounded recordings; 14: stroke segments; 15: uint16 KEY_SENSOR_RATE
+
+
+////////////////////////////////////////
+// message keys
+
+// 0x46 0x4D = ascii "FM"
+
+enum
+{
+    KEYS_BEGIN = 0x464d0000-1,
+
+    // sent from phone to start recording on watch (optionally with a StartLimit, to stop after that many samples),
+    // or sent from watch to notify phone that recording was initiated on watch
+    KEY_START,
+
+    // sent from phone to stop recording on watch,
+    // and also sent from watch to notify phone that recording has completed and all data has been sent
+    KEY_STOP,
+
+    // sensor data sent from watch (array of Sample, or of the channels and in the codec given in Config)
+    KEY_SENSOR_DATA,
+
+    // metadata sent from watch (binary record of META_* entries, see "device metadata" below)
+    KEY_METADATA,
+
+    // index of the first sample in KEY_SENSOR_DATA (uint32), counted from the start of the recording,
+    // including samples that were dropped
+    KEY_SENSOR_OFFSET,
+
+    // sent from phone to try to connect (with app and protocol version)
+    // or sent from watch to confirm connection (with connection id)
+    KEY_CONNECT,
+
+    // sent from phone or watch to disconnect
+    KEY_DISCONNECT,
+
+    // indicates that the containing message was resent (uint8: number of times it has been resent)
+    KEY_RESEND,
+
+    // sampling rate of sensor data
+    KEY_SENSOR_RATE,
+
+    // periodic message to detect disconnection
+    KEY_HEARTBEAT,
+
+    // recording configuration (Config struct);
+    // sent from phone along with KEY_CONNECT, and echoed back by the watch with the values actually applied
+    KEY_CONFIG,
+
+    // hash of the metadata record (see "hashes" below);
+    // sent from phone with KEY_CONNECT if it has a cached copy (so the watch can skip sending KEY_METADATA),
+    // and always sent from watch in the connect acknowledgement, with the hash of the metadata as it is then
+    // (some entries, such as META_STREAMS, can change while the watch app runs)
+    KEY_METADATA_HASH,
+
+    // reserved; every frame fits in one message, so none is ever split
+    KEY_FRAGMENT,
+
+    // bulk download of a blob from phone to watch (see "bulk download" in focusmotion.c)
+    KEY_BLOB_BEGIN, // sent from phone to announce a blob (BlobInfo)
+    KEY_BLOB_CHUNK, // sent from phone with one chunk of a blob (BlobChunkHeader followed by data)
+    KEY_BLOB_ACK,   // sent from watch in reply to either of the above (BlobAck)
+
+    // sent from phone to start a benchmark recording at the given sample rate (uint16, in Hz),
+    // and sent from watch with KEY_STOP when a benchmark recording completes (BenchmarkResult)
+    KEY_BENCHMARK,
+
+    // frames of other sensors' data sent from watch, along with the accelerometer's (see "sensor streams" below)
+    KEY_STREAM_FRAMES,
+
+    // processing stages for the watch to run on each accelerometer batch (StageConfig[]), sent from phone;
+    // replaces the stages set by the previous KEY_STAGES, and may be sent while recording
+    KEY_STAGES,
+
+    // sent from watch when a KEY_CONFIG the phone sent while recording takes effect (ReconfigMarker)
+    KEY_RECONFIG,
+
+    // sent from watch with KEY_START (uint16) when the watch was armed: the number of samples at the start of
+    // the recording that were recorded before it started, so the sample at this offset is the first after the start.
+    // The pre-roll is sampled at a lower rate, and sent in its own messages with their own KEY_SENSOR_RATE;
+    // the samples between its last batch and the start were never delivered, so they are skipped.
+    KEY_PREROLL,
+
+    // sent from watch when strokes have ended, once all their samples have been sent (Segment[]; see "stroke segments" below)
+    KEY_SEGMENTS,
+
+
+    KEYS_END // insert new values BEFORE this
+};
+
+
+////////////////////////////////////////
+// samples
+
+// one accelerometer sample, in milli-g
+typedef struct __attribute__ ((__packed__))
+{
+    int16_t x;
+    int16_t y;
+    int16_t z;
+} Sample;
+
+// channels that can be recorded, selected by Config.channels; each is an int16, and a sample holds the selected
+// channels in this order (so with the default CHANNELS_XYZ, a sample is a Sample struct)
+#define CHANNEL_X         0x01 // milli-g
+#define CHANNEL_Y         0x02
+#define CHANNEL_Z         0x04
+#define CHANNEL_MAGNITUDE 0x08 // length of (x, y, z), in milli-g
+#define CHANNEL_PITCH     0x10 // rotation about the y axis, atan2(-x, sqrt(y*y + z*z)); 0x10000 = 360 degrees, so -0x8000..0x7fff is -180..180
+#define CHANNEL_ROLL      0x20 // rotation about the x axis, atan2(y, z), in the same units
+#define CHANNELS_XYZ (CHANNEL_X | CHANNEL_Y | CHANNEL_Z)
+#define CHANNELS_ALL 0x3f
+#define CHANNELS_MAX 6
+
+
+////////////////////////////////////////
+// recording configuration
+
+enum
+{
+    CODEC_RAW = 0,   // array of samples, each of which has the selected channels
+    CODEC_LOSSY = 1, // quantized and delta-coded samples, within Config.max_error of the originals (see below)
+    CODEC_PACKED40 = 2, // samples packed in 5 bytes each (see below)
+};
+
+#define CONFIG_FLAG_START 0x01 // start recording as soon as connected
+#define CONFIG_FLAG_ARM   0x02 // arm the watch (keep the accelerometer running between recordings, so they start with a pre-roll)
+#define CONFIG_FLAG_DISARM 0x04 // disarm the watch, if it was armed
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint8_t sampling_rate; // AccelSamplingRate, in Hz
+    uint8_t codec; // one of CODEC_*
+    uint8_t samples_per_update; // accelerometer batch size
+    uint8_t flags; // CONFIG_FLAG_*
+    uint8_t max_error; // for CODEC_LOSSY: maximum absolute error per axis, in mg (added in protocol version 6)
+    uint8_t channels; // CHANNEL_* bitmask; 0 for CHANNELS_XYZ.  Codecs other than CODEC_RAW need CHANNELS_XYZ (added in protocol version 8)
+    uint8_t streams; // bitmask of (1 << STREAM_*) to record besides the accelerometer (added in protocol version 9)
+    uint8_t segment; // SEGMENT_* (added in protocol version 14)
+    uint8_t segment_threshold; // for SEGMENT_MOTION: in units of SEGMENT_THRESHOLD_UNIT; 0 for SEGMENT_DEFAULT_THRESHOLD
+} Config;
+
+#define CONFIG_MIN_SIZE 4 // size of Config sent by protocol version 5; missing fields are zero
+
+// A Config sent while recording changes the recording without stopping it.  The watch applies it at the next
+// point where all the samples and stream values it has buffered have been sent, and then sends a marker with the
+// offset of the first sample recorded with the new configuration; data from that offset on uses the new sampling
+// rate, channels and codec.  (KEY_SENSOR_RATE in each message also has the rate of its samples.)
+// A change of rate or batch size restarts the accelerometer, so the boundary is exact; the readings still queued
+// at the old rate are lost and show up as a gap (of at most one batch) just before the marker's offset.
+// If the link can't keep up, so that point doesn't come within about 20 messages, the watch drops new samples and
+// stream values (leaving a gap in the offsets) until its buffers are empty.
+typedef struct __attribute__ ((__packed__))
+{
+    uint32_t offset; // KEY_SENSOR_OFFSET of the first sample with the new configuration
+    Config config; // the configuration actually applied
+} ReconfigMarker;
+
+// KEY_START from the phone may carry a StartLimit, so the recording stops on an exact sample rather than whenever
+// KEY_STOP arrives.  The watch stops after the sample at offset samples - 1 (counting pre-roll and dropped samples,
+// like KEY_SENSOR_OFFSET), sends what it has buffered, and then sends KEY_STOP as usual.  A duration is converted to
+// a sample count at the sampling rate the recording starts with; if both are given, the smaller limit applies.
+typedef struct __attribute__ ((__packed__))
+{
+    uint32_t samples; // 0 for no limit
+    uint32_t duration_ms; // 0 for no limit
+} StartLimit;
+
+
+////////////////////////////////////////
+// lossy codec
+// A CODEC_LOSSY payload has a header:
+//   uint8      max_error e; each axis is quantized with step q = 2e+1, so that v = round(v/q)*q +/- e
+//   uint16     number of samples
+//   int16[3]   quantized x, y, z of the first sample
+// followed by a bit stream (least significant bit first) of blocks of up to LOSSY_BLOCK_SIZE further samples.
+// Each block has a 5-bit width for each axis (x, y, z), followed by the residuals of each sample (x, y, z),
+// using the width of its axis.  A residual is the zigzag-coded difference between a quantized value and the
+// previous sample's ((d << 1) ^ (d >> 31), so small differences of either sign are small); a decoder keeps
+// the running quantized values and multiplies them by q.
+
+#define LOSSY_HEADER_SIZE 9
+#define LOSSY_BLOCK_SIZE 16
+#define LOSSY_WIDTH_BITS 5
+
+
+////////////////////////////////////////
+// packed codec
+// A CODEC_PACKED40 payload is an array of 5-byte samples, each of which is a little-endian 40-bit value
+// holding x in bits 0-12, y in bits 13-25 and z in bits 26-38, as 13-bit two's complement.
+// The accelerometer's range is +/-4000 mg, so this is lossless; values outside -4096..4095 are clamped.
+
+#define PACKED40_SAMPLE_SIZE 5
+#define PACKED40_BITS 13
+
+
+////////////////////////////////////////
+// device metadata
+// The metadata record is a sequence of entries, each of which is a one-byte tag (META_*),
+// a one-byte length, and the value.  Multi-byte values are little-endian.
+
+enum
+{
+    META_HARDWARE_MODEL = 1, // uint8: WatchInfoModel
+    META_APP_UUID_HASH,      // uint32: hash of the app's 16-byte UUID (see "hashes")
+    META_APP_VERSION,        // uint8[2]: major, minor
+    META_SDK_VERSION,        // uint8[3]: major, minor, build
+    META_SDK_LABEL,          // char[]: version label, not null-terminated; omitted if empty
+    META_CODECS,             // uint8: bitmask of supported CODEC_* values
+    META_TRANSPORTS,         // uint8: bitmask of supported TRANSPORT_* values
+    META_MAX_OUTBOX,         // uint16: outbox size in bytes
+    META_STREAMS,            // uint8: bitmask of (1 << STREAM_*) for the sensors this watch has
+};
+
+#define TRANSPORT_APP_MESSAGE 0x01
+
+#define METADATA_MAX_SIZE 48
+
+
+////////////////////////////////////////
+// hashes
+// KEY_METADATA_HASH, META_APP_UUID_HASH and BlobInfo.hash are 32-bit FNV-1a hashes: start with HASH_OFFSET_BASIS,
+// and for each byte in order, xor the byte into the hash and then multiply it by HASH_PRIME (modulo 2^32).
+
+#define HASH_OFFSET_BASIS 2166136261u
+#define HASH_PRIME 16777619u
+
+
+////////////////////////////////////////
+// bulk download
+
+#define BLOB_CHUNK_SIZE 256 // maximum data bytes in one KEY_BLOB_CHUNK
+
+enum
+{
+    BLOB_STATUS_OK,       // send the chunk at next_index
+    BLOB_STATUS_COMPLETE, // the watch has the whole blob; nothing more to send
+    BLOB_STATUS_ERROR,    // blob is too large, storage is full, or the hash didn't match
+};
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint8_t slot;
+    uint32_t hash; // hash of the blob's contents (see "hashes")
+    uint16_t size; // size of the blob in bytes
+} BlobInfo;
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint8_t slot;
+    uint8_t index;
+} BlobChunkHeader;
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint8_t slot;
+    uint8_t next_index;
+    uint8_t status; // one of BLOB_STATUS_*
+} BlobAck;
+
+
+////////////////////////////////////////
+// benchmark
+// The reading at offset n of a benchmark recording is { n, -n, n ^ 0x5555 } (truncated to 16 bits),
+// so the phone can check the data it receives.  It goes through the configured channels and codec like a real
+// reading: with CHANNELS_XYZ the sample is exactly that, and with another mask the sample has the selected channels
+// of that reading (e.g. CHANNEL_MAGNITUDE is the length of (n, -n, n ^ 0x5555), saturated to int16).
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint16_t rate; // requested sample rate in Hz
+    uint32_t elapsed_ms;
+    uint32_t samples_measured; // samples generated
+    uint32_t samples_sent;
+    uint32_t samples_acked;
+    uint32_t samples_dropped;
+    uint32_t messages_failed;
+    uint32_t goodput; // sensor data bytes acknowledged per second
+    uint16_t latency_avg_ms;
+    uint16_t latency_max_ms;
+} BenchmarkResult;
+
+
+////////////////////////////////////////
+// sensor streams
+// Besides the accelerometer, whose samples are sent with KEY_SENSOR_DATA, the watch can record the other sensors
+// selected by Config.streams.  They are read once per accelerometer batch, so they don't wake the watch on their own,
+// and they are sent in the same messages as the accelerometer data: KEY_STREAM_FRAMES holds a sequence of frames,
+// each of which is a StreamFrameHeader followed by count values in the frame's codec.
+// When the outbox is short, the streams that have data take turns and get an equal share of it.
+
+enum
+{
+    STREAM_ACCEL = 0,      // sent with KEY_SENSOR_DATA, never in a frame
+    STREAM_COMPASS = 1,    // magnetic heading; 0x10000 = 360 degrees, so -0x8000..0x7fff is -180..180
+    STREAM_HEART_RATE = 2, // beats per minute
+};
+
+#define STREAM_VALUE_INVALID INT16_MIN // the sensor had no reading, e.g. while the compass is calibrating
+
+enum
+{
+    STREAM_CODEC_INT16 = 0, // array of int16
+};
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint8_t stream; // STREAM_*
+    uint8_t codec; // STREAM_CODEC_*
+    uint16_t period_ms; // time between values
+    uint32_t offset; // index of the first value since recording started, including values that were dropped
+    uint16_t count; // number of values that follow
+} StreamFrameHeader;
+
+
+////////////////////////////////////////
+// processing stages
+// The watch runs these in order, in place, on each accelerometer batch before storing it, after any stages
+// the watch app added itself.  They are fixed point, and the data they produce is in the usual units.
+
+enum
+{
+    STAGE_REMOVE_GRAVITY = 1, // subtracts the running mean of each axis
+    STAGE_LOW_PASS = 2,       // replaces each axis by its running mean
+    STAGE_CLIP_DETECT = 3,    // counts readings with an axis at or beyond a threshold (i.e. the sensor saturated)
+    STAGE_CALIBRATE = 4,      // v' = (v + offset) * scale / 256, per axis
+};
+
+#define STAGES_MAX 6
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint8_t type; // STAGE_*
+    uint8_t shift; // STAGE_REMOVE_GRAVITY, STAGE_LOW_PASS: the running mean moves 1/2^shift of the way to each reading
+    uint16_t budget_ms; // time allowed per batch; batches that take longer are counted in the stage's stats (0 for no budget)
+    int16_t param[6]; // STAGE_CLIP_DETECT: param[0] is the threshold in mg; STAGE_CALIBRATE: x, y, z offsets, then scales
+} StageConfig;
+
+
+////////////////////////////////////////
+// stroke segments
+// With Config.segment other than SEGMENT_NONE, the watch only sends the accelerometer samples within strokes (e.g. while
+// a letter is traced).  The samples between strokes are skipped, and the offsets in the data messages skip over them
+// just as they skip over dropped samples.  When a stroke ends, the watch sends its Segment with KEY_SEGMENTS, in the
+// message with the stroke's last samples or a later one, so the phone can handle each stroke once its marker arrives.
+// A stroke that is still going on when the recording stops ends there.  Other sensors' streams are not segmented.
+// If the link stalls so that the watch has several strokes' markers waiting, later strokes are merged into the last
+// waiting Segment, which then covers them and the (still skipped) samples between them.
+
+enum
+{
+    SEGMENT_NONE = 0,   // send every sample
+    SEGMENT_MANUAL = 1, // strokes are marked by the watch app (e.g. while a button is held)
+    SEGMENT_MOTION = 2, // strokes are detected from the motion (see below)
+};
+
+// SEGMENT_MOTION measures the motion as the sum of each axis's distance from its slow running mean.  A stroke starts
+// at the first sample at or above the threshold, and ends once the motion has stayed below half the threshold for
+// SEGMENT_QUIET_MS.
+#define SEGMENT_THRESHOLD_UNIT 4 // mg
+#define SEGMENT_DEFAULT_THRESHOLD 80 // mg
+#define SEGMENT_QUIET_MS 250
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint32_t offset; // KEY_SENSOR_OFFSET of the stroke's first sample
+    uint32_t length; // number of samples, including any that were dropped
+} Segment;
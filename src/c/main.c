@@ -5,11 +5,17 @@
 static Window* g_window = NULL;
 static TextLayer* g_title_layer = NULL;
 static TextLayer* g_status_layer = NULL;
+static TextLayer* g_stats_layer = NULL;
 
 static GBitmap* g_record_bitmap = NULL;
 static GBitmap* g_stop_bitmap = NULL;
 static ActionBarLayer* g_action_bar = NULL;
 
+static AppTimer* g_stats_timer = NULL;
+
+#define BENCHMARK_RATE 400 // Hz
+#define STATS_TIMER_MS 1000
+
 ////////////////////////////////////////
 
 static void click_handler(ClickRecognizerRef recognizer, void* context)
@@ -28,9 +34,54 @@ static void click_handler(ClickRecognizerRef recognizer, void* context)
     }
 }
 
+static void benchmark_click_handler(ClickRecognizerRef recognizer, void* context)
+{
+    if (focusmotion_is_connected())
+    {
+        // toggle benchmark with up button
+        if (focusmotion_is_recording())
+        {
+            focusmotion_stop_recording();
+        }
+        else
+        {
+            focusmotion_start_benchmark(BENCHMARK_RATE);
+        }
+    }
+}
+
+// hold the down button while tracing a stroke, if the phone asked for segments marked on the watch
+static void pen_down_handler(ClickRecognizerRef recognizer, void* context)
+{
+    focusmotion_set_pen_down(true);
+}
+
+static void pen_up_handler(ClickRecognizerRef recognizer, void* context)
+{
+    focusmotion_set_pen_down(false);
+}
+
 static void click_config_provider(void* context)
 {
     window_single_click_subscribe(BUTTON_ID_SELECT, click_handler);
+    window_single_click_subscribe(BUTTON_ID_UP, benchmark_click_handler);
+    window_raw_click_subscribe(BUTTON_ID_DOWN, pen_down_handler, pen_up_handler, NULL);
+}
+
+static void update_stats()
+{
+    static char text[64];
+    FmStats stats;
+    focusmotion_get_stats(&stats);
+    snprintf(text, sizeof(text), "%d B/s  %d ms\n%d dropped",
+             (int) stats.goodput, (int) stats.latency_avg_ms, (int) stats.samples_dropped);
+    text_layer_set_text(g_stats_layer, text);
+}
+
+static void stats_timer_callback(void* data)
+{
+    update_stats();
+    g_stats_timer = app_timer_register(STATS_TIMER_MS, stats_timer_callback, NULL);
 }
 
 static void update_ui()
@@ -40,7 +91,7 @@ static void update_ui()
         if (focusmotion_is_recording())
         {
             action_bar_layer_set_icon(g_action_bar, BUTTON_ID_SELECT, g_stop_bitmap);
-            text_layer_set_text(g_status_layer, "recording");
+            text_layer_set_text(g_status_layer, focusmotion_is_benchmarking() ? "benchmarking" : "recording");
         }
         else
         {
@@ -62,12 +113,28 @@ static void connected_handler(bool connected)
 
 static void recording_handler(bool recording)
 {
-    // vibrate when starting/stopping
-    static const uint32_t pulse = 100;
-    VibePattern pat;
-    pat.durations = &pulse;
-    pat.num_segments = 1;
-    vibes_enqueue_custom_pattern(pat);
+    // vibrate when starting/stopping (but not when benchmarking, which would disturb the measurement)
+    if (!focusmotion_is_benchmarking())
+    {
+        static const uint32_t pulse = 100;
+        VibePattern pat;
+        pat.durations = &pulse;
+        pat.num_segments = 1;
+        vibes_enqueue_custom_pattern(pat);
+    }
+
+    // show link statistics while benchmarking; leave the final ones on screen when it stops
+    if (recording && focusmotion_is_benchmarking())
+    {
+        text_layer_set_text(g_stats_layer, "");
+        stats_timer_callback(NULL);
+    }
+    else if (g_stats_timer)
+    {
+        app_timer_cancel(g_stats_timer);
+        g_stats_timer = NULL;
+        update_stats();
+    }
 
     update_ui();
 }
@@ -100,6 +167,14 @@ static void init()
     text_layer_set_text_alignment(g_status_layer, GTextAlignmentLeft);
     layer_add_child(window_layer, text_layer_get_layer(g_status_layer));
 
+    // layer for displaying benchmark results
+    g_stats_layer = text_layer_create((GRect) { .origin = { 13, 120 }, .size = { bounds.size.w, 40 } });
+    text_layer_set_text_color(g_stats_layer, GColorWhite);
+    text_layer_set_background_color(g_stats_layer, GColorBlack);
+    text_layer_set_font(g_stats_layer, fonts_get_system_font(FONT_KEY_GOTHIC_14));
+    text_layer_set_text_alignment(g_stats_layer, GTextAlignmentLeft);
+    layer_add_child(window_layer, text_layer_get_layer(g_stats_layer));
+
     // action bar
     g_record_bitmap = gbitmap_create_with_resource(RESOURCE_ID_IMAGE_RECORD);
     g_stop_bitmap = gbitmap_create_with_resource(RESOURCE_ID_IMAGE_STOP);
@@ -120,9 +195,15 @@ static void deinit()
 {
     focusmotion_shutdown();
 
+    if (g_stats_timer)
+    {
+        app_timer_cancel(g_stats_timer);
+    }
+
     action_bar_layer_destroy(g_action_bar);
     gbitmap_destroy(g_record_bitmap);
     gbitmap_destroy(g_stop_bitmap);
+    text_layer_destroy(g_stats_layer);
     text_layer_destroy(g_status_layer);
     text_layer_destroy(g_title_layer);
     window_destroy(g_window);